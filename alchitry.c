@@ -0,0 +1,263 @@
+#include "alchitry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boards.h"
+#include "session.h"
+
+struct alchitry_session {
+  struct session s;
+  struct progress progress;
+  double config_freq;
+  double bridge_freq;
+};
+
+static void copy_board(struct alchitry_board *board,
+                       const struct board_info *info);
+static int list_boards(struct board_info **found, int *n);
+static int prepare(alchitry_session *a);
+static int run(alchitry_session *a, struct options *opt);
+
+const char *alchitry_strerror(int status) {
+  switch (status) {
+  case ALCHITRY_OK:
+    return "Success";
+  case ALCHITRY_ERR_ARG:
+    return "Invalid argument";
+  case ALCHITRY_ERR_NO_MEM:
+    return "Out of memory";
+  case ALCHITRY_ERR_USB:
+    return "Failed to list USB devices";
+  case ALCHITRY_ERR_NOT_FOUND:
+    return "Board not found";
+  case ALCHITRY_ERR_OPEN:
+    return "Failed to open board";
+  case ALCHITRY_ERR_UNSUPPORTED:
+    return "Not supported by this board";
+  case ALCHITRY_ERR_FAILED:
+    return "Operation failed";
+  default:
+    return "Unknown error";
+  }
+}
+
+void copy_board(struct alchitry_board *board,
+                const struct board_info *info) {
+  memset(board, 0, sizeof(*board));
+  board->type = info->type == BOARD_AU   ? ALCHITRY_AU
+                : info->type == BOARD_CU ? ALCHITRY_CU
+                                         : -1;
+  strcpy(board->desc, info->desc);
+  strcpy(board->serial, info->serial);
+  strcpy(board->path, info->path);
+}
+
+int list_boards(struct board_info **found, int *n) {
+  struct ftdi_context *ftdi = ftdi_new();
+
+  *found = NULL;
+  if (ftdi == NULL)
+    return ALCHITRY_ERR_NO_MEM;
+  *n = boards_scan(ftdi, found);
+  ftdi_free(ftdi);
+  if (*n < 0) {
+    *n = 0;
+    return ALCHITRY_ERR_USB;
+  }
+  return ALCHITRY_OK;
+}
+
+int alchitry_list(struct alchitry_board **boards, int *n) {
+  struct board_info *found;
+  int status;
+
+  if (boards == NULL || n == NULL)
+    return ALCHITRY_ERR_ARG;
+  *boards = NULL;
+  *n = 0;
+  if ((status = list_boards(&found, n)) != ALCHITRY_OK)
+    return status;
+
+  struct alchitry_board *list = calloc(*n > 0 ? *n : 1, sizeof(*list));
+  if (list == NULL) {
+    free(found);
+    *n = 0;
+    return ALCHITRY_ERR_NO_MEM;
+  }
+  for (int i = 0; i < *n; i++)
+    copy_board(&list[i], &found[i]);
+  free(found);
+
+  *boards = list;
+  return ALCHITRY_OK;
+}
+
+void alchitry_free(void *p) { free(p); }
+
+int alchitry_open(const char *key, alchitry_session **session) {
+  struct board_info *found;
+  int n, index, status;
+
+  if (key == NULL || session == NULL)
+    return ALCHITRY_ERR_ARG;
+  *session = NULL;
+  if ((status = list_boards(&found, &n)) != ALCHITRY_OK)
+    return status;
+
+  if ((index = board_find(found, n, key)) < 0) {
+    free(found);
+    return ALCHITRY_ERR_NOT_FOUND;
+  }
+  if (found[index].type != BOARD_AU && found[index].type != BOARD_CU) {
+    free(found);
+    return ALCHITRY_ERR_UNSUPPORTED;
+  }
+
+  alchitry_session *a = calloc(1, sizeof(*a));
+  if (a == NULL) {
+    free(found);
+    return ALCHITRY_ERR_NO_MEM;
+  }
+  a->s.index = index;
+  a->s.info = found[index];
+  a->config_freq = LOADER_CONFIG_FREQ;
+  a->bridge_freq = LOADER_BRIDGE_FREQ;
+  free(found);
+
+  if ((status = prepare(a)) != ALCHITRY_OK) {
+    free(a);
+    return status;
+  }
+  *session = a;
+  return ALCHITRY_OK;
+}
+
+void alchitry_close(alchitry_session *session) {
+  if (session == NULL)
+    return;
+  session_close(&session->s);
+  free(session);
+}
+
+int alchitry_board(const alchitry_session *session,
+                   struct alchitry_board *board) {
+  if (session == NULL || board == NULL)
+    return ALCHITRY_ERR_ARG;
+
+  copy_board(board, &session->s.info);
+  return ALCHITRY_OK;
+}
+
+void alchitry_set_progress(alchitry_session *session,
+                           alchitry_progress_fn fn, void *arg) {
+  if (session == NULL)
+    return;
+  session->progress.fn = fn;
+  session->progress.arg = arg;
+}
+
+int alchitry_set_freq(alchitry_session *session, double config_freq,
+                      double bridge_freq) {
+  if (session == NULL || !(config_freq > 0) || !(bridge_freq > 0))
+    return ALCHITRY_ERR_ARG;
+  session->config_freq = config_freq;
+  session->bridge_freq = bridge_freq;
+  return ALCHITRY_OK;
+}
+
+// Reopen the session if an earlier step failed and hook up the progress
+// callback
+int prepare(alchitry_session *a) {
+  struct session *s = &a->s;
+
+  if (s->ftdi == NULL && !session_open(s))
+    return ALCHITRY_ERR_OPEN;
+  if (s->jtag)
+    s->jtag->progress = a->progress;
+  if (s->spi)
+    s->spi->progress = a->progress;
+  return ALCHITRY_OK;
+}
+
+int run(alchitry_session *a, struct options *opt) {
+  int status;
+
+  if ((status = prepare(a)) != ALCHITRY_OK)
+    return status;
+  opt->config_freq = a->config_freq;
+  opt->bridge_freq = a->bridge_freq;
+  return session_run(&a->s, opt) ? ALCHITRY_OK : ALCHITRY_ERR_FAILED;
+}
+
+int alchitry_load_ram(alchitry_session *session, const char *bin) {
+  if (session == NULL || bin == NULL)
+    return ALCHITRY_ERR_ARG;
+
+  struct options opt = {.fpga_ram = true, .fpga_bin_ram = (char *)bin};
+  return run(session, &opt);
+}
+
+int alchitry_write_flash(alchitry_session *session, const char *bin,
+                         const char *bridge_bin) {
+  if (session == NULL || bin == NULL ||
+      (session->s.info.type == BOARD_AU && bridge_bin == NULL))
+    return ALCHITRY_ERR_ARG;
+
+  struct options opt = {.fpga_flash = true,
+                        .fpga_bin_flash = (char *)bin,
+                        .au_bridge_bin = (char *)bridge_bin};
+  return run(session, &opt);
+}
+
+int alchitry_erase_flash(alchitry_session *session, const char *bridge_bin) {
+  if (session == NULL ||
+      (session->s.info.type == BOARD_AU && bridge_bin == NULL))
+    return ALCHITRY_ERR_ARG;
+
+  struct options opt = {.erase = true, .au_bridge_bin = (char *)bridge_bin};
+  return run(session, &opt);
+}
+
+int alchitry_verify(alchitry_session *session, const char *bin,
+                    const char *mask) {
+  if (session == NULL || bin == NULL)
+    return ALCHITRY_ERR_ARG;
+
+  struct options opt = {.fpga_verify = true,
+                        .fpga_bin_verify = (char *)bin,
+                        .mask_file = (char *)mask};
+  return run(session, &opt);
+}
+
+int alchitry_read_flash(alchitry_session *session, size_t size,
+                        uint8_t **data, size_t *len) {
+  long n;
+  int status;
+
+  if (session == NULL || data == NULL || len == NULL)
+    return ALCHITRY_ERR_ARG;
+  *data = NULL;
+  *len = 0;
+  if (session->s.info.type != BOARD_CU)
+    return ALCHITRY_ERR_UNSUPPORTED;
+  if ((status = prepare(session)) != ALCHITRY_OK)
+    return status;
+
+  if (!spi_read_flash_buf(session->s.spi, size, data, &n)) {
+    session_close(&session->s);
+    return ALCHITRY_ERR_FAILED;
+  }
+  *len = n;
+  return ALCHITRY_OK;
+}
+
+int alchitry_play_svf(alchitry_session *session, const char *svf) {
+  if (session == NULL || svf == NULL)
+    return ALCHITRY_ERR_ARG;
+  if (session->s.info.type != BOARD_AU)
+    return ALCHITRY_ERR_UNSUPPORTED;
+
+  struct options opt = {.svf = true, .svf_file = (char *)svf};
+  return run(session, &opt);
+}
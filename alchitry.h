@@ -0,0 +1,95 @@
+#ifndef ALCHITRY_H_
+#define ALCHITRY_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libalchitry, the loader as a library. Every call returns ALCHITRY_OK or
+ * one of the negative ALCHITRY_ERR_* codes, details of a failed step go to
+ * stderr. A session keeps its board open and set up between calls; one
+ * whose step fails starts over with the next call.
+ */
+
+// The library is built with hidden visibility, only these calls are
+// exported
+#ifdef __GNUC__
+#define ALCHITRY_API __attribute__((visibility("default")))
+#else
+#define ALCHITRY_API
+#endif
+
+#define ALCHITRY_AU 0
+#define ALCHITRY_CU 1
+
+enum alchitry_status {
+  ALCHITRY_OK = 0,
+  ALCHITRY_ERR_ARG = -1,         // bad argument
+  ALCHITRY_ERR_NO_MEM = -2,      // out of memory
+  ALCHITRY_ERR_USB = -3,         // listing the USB devices failed
+  ALCHITRY_ERR_NOT_FOUND = -4,   // no board matches the key
+  ALCHITRY_ERR_OPEN = -5,        // the board couldn't be opened or set up
+  ALCHITRY_ERR_UNSUPPORTED = -6, // the board can't do that
+  ALCHITRY_ERR_FAILED = -7,      // the step itself failed
+};
+
+struct alchitry_board {
+  int type; // ALCHITRY_AU, ALCHITRY_CU or -1 for anything else
+  char desc[64];
+  char serial[16];
+  char path[32]; // USB bus-port.port..., stays put across replugs
+};
+
+typedef struct alchitry_session alchitry_session;
+
+// Told how far a long transfer has got, done out of total bytes. Called
+// from the thread running the step.
+typedef void (*alchitry_progress_fn)(void *arg, size_t done, size_t total);
+
+ALCHITRY_API const char *alchitry_strerror(int status);
+
+// The connected boards, in the order a key of "0", "1"... picks them.
+// *boards is freed with alchitry_free().
+ALCHITRY_API int alchitry_list(struct alchitry_board **boards, int *n);
+ALCHITRY_API void alchitry_free(void *p);
+
+// Open the board a key names: its place in the list, its serial or its USB
+// path
+ALCHITRY_API int alchitry_open(const char *key, alchitry_session **session);
+ALCHITRY_API void alchitry_close(alchitry_session *session);
+ALCHITRY_API int alchitry_board(const alchitry_session *session,
+                                struct alchitry_board *board);
+
+ALCHITRY_API void alchitry_set_progress(alchitry_session *session,
+                                        alchitry_progress_fn fn, void *arg);
+// TCK in Hz while configuring and while talking to the flash bridge (Au)
+ALCHITRY_API int alchitry_set_freq(alchitry_session *session,
+                                   double config_freq, double bridge_freq);
+
+ALCHITRY_API int alchitry_load_ram(alchitry_session *session,
+                                   const char *bin);
+// The Au writes and erases its flash through the bridge bitstream in
+// bridge_bin, the Cu ignores it
+ALCHITRY_API int alchitry_write_flash(alchitry_session *session,
+                                      const char *bin, const char *bridge_bin);
+ALCHITRY_API int alchitry_erase_flash(alchitry_session *session,
+                                      const char *bridge_bin);
+// Checks the Au configuration, bits set in mask (may be NULL) ignored, or
+// the Cu flash
+ALCHITRY_API int alchitry_verify(alchitry_session *session, const char *bin,
+                                 const char *mask);
+// Read the first size bytes of Cu flash, all of it for 0. *data is freed
+// with alchitry_free().
+ALCHITRY_API int alchitry_read_flash(alchitry_session *session, size_t size,
+                                     uint8_t **data, size_t *len);
+ALCHITRY_API int alchitry_play_svf(alchitry_session *session,
+                                   const char *svf);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* ALCHITRY_H_ */
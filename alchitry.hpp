@@ -0,0 +1,163 @@
+#ifndef ALCHITRY_HPP_
+#define ALCHITRY_HPP_
+
+// Header only C++ wrapper around libalchitry. Failures throw
+// alchitry::error, sessions close themselves and both sessions and buffers
+// can be moved but not copied.
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "alchitry.h"
+
+namespace alchitry {
+
+using board = struct alchitry_board;
+
+class error : public std::runtime_error {
+public:
+  explicit error(int status)
+      : std::runtime_error(alchitry_strerror(status)), status_(status) {}
+  int status() const noexcept { return status_; }
+
+private:
+  int status_;
+};
+
+inline void check(int status) {
+  if (status != ALCHITRY_OK)
+    throw error(status);
+}
+
+// Bytes the library allocated, freed along with the buffer
+class buffer {
+public:
+  buffer() noexcept = default;
+  buffer(uint8_t *data, size_t size) noexcept : data_(data), size_(size) {}
+  buffer(buffer &&other) noexcept : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+  buffer &operator=(buffer &&other) noexcept {
+    if (this != &other) {
+      alchitry_free(data_);
+      data_ = other.data_;
+      size_ = other.size_;
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+    return *this;
+  }
+  buffer(const buffer &) = delete;
+  buffer &operator=(const buffer &) = delete;
+  ~buffer() { alchitry_free(data_); }
+
+  const uint8_t *data() const noexcept { return data_; }
+  size_t size() const noexcept { return size_; }
+  const uint8_t *begin() const noexcept { return data_; }
+  const uint8_t *end() const noexcept { return data_ + size_; }
+
+private:
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+inline std::vector<board> list() {
+  board *boards;
+  int n;
+
+  check(alchitry_list(&boards, &n));
+  std::vector<board> v(boards, boards + n);
+  alchitry_free(boards);
+  return v;
+}
+
+// An open board, picked by its place in list(), its serial or its USB path
+class session {
+public:
+  // Called with the bytes done and the total, must not throw
+  using progress_fn = std::function<void(size_t done, size_t total)>;
+
+  explicit session(const std::string &key = "0") {
+    check(alchitry_open(key.c_str(), &s_));
+  }
+  session(session &&other) noexcept
+      : s_(other.s_), progress_(std::move(other.progress_)) {
+    other.s_ = nullptr;
+  }
+  session &operator=(session &&other) noexcept {
+    if (this != &other) {
+      alchitry_close(s_);
+      s_ = other.s_;
+      progress_ = std::move(other.progress_);
+      other.s_ = nullptr;
+    }
+    return *this;
+  }
+  session(const session &) = delete;
+  session &operator=(const session &) = delete;
+  ~session() { alchitry_close(s_); }
+
+  board info() const {
+    board b;
+    check(alchitry_board(s_, &b));
+    return b;
+  }
+
+  // The callback lives on the heap so it stays put when the session moves
+  void on_progress(progress_fn fn) {
+    if (fn) {
+      progress_.reset(new progress_fn(std::move(fn)));
+      alchitry_set_progress(s_, call_progress, progress_.get());
+    } else {
+      alchitry_set_progress(s_, nullptr, nullptr);
+      progress_.reset();
+    }
+  }
+
+  void set_freq(double config_freq, double bridge_freq) {
+    check(alchitry_set_freq(s_, config_freq, bridge_freq));
+  }
+
+  void load_ram(const std::string &bin) {
+    check(alchitry_load_ram(s_, bin.c_str()));
+  }
+  void write_flash(const std::string &bin, const std::string &bridge = "") {
+    check(alchitry_write_flash(s_, bin.c_str(), c_str_or_null(bridge)));
+  }
+  void erase_flash(const std::string &bridge = "") {
+    check(alchitry_erase_flash(s_, c_str_or_null(bridge)));
+  }
+  void verify(const std::string &bin, const std::string &mask = "") {
+    check(alchitry_verify(s_, bin.c_str(), c_str_or_null(mask)));
+  }
+  buffer read_flash(size_t size = 0) {
+    uint8_t *data;
+    size_t len;
+    check(alchitry_read_flash(s_, size, &data, &len));
+    return buffer(data, len);
+  }
+  void play_svf(const std::string &svf) {
+    check(alchitry_play_svf(s_, svf.c_str()));
+  }
+
+private:
+  static void call_progress(void *arg, size_t done, size_t total) {
+    (*static_cast<progress_fn *>(arg))(done, total);
+  }
+  static const char *c_str_or_null(const std::string &s) {
+    return s.empty() ? nullptr : s.c_str();
+  }
+
+  alchitry_session *s_ = nullptr;
+  std::unique_ptr<progress_fn> progress_;
+};
+
+} // namespace alchitry
+
+#endif /* ALCHITRY_HPP_ */
@@ -8,18 +8,15 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "boards.h"
+#include "daemon.h"
+#include "image.h"
 #include "jtag.h"
 #include "jtag_fsm.h"
 #include "loader.h"
+#include "session.h"
 #include "spi.h"
-
-#define BOARD_ERROR -2
-#define BOARD_UNKNOWN -1
-#define BOARD_AU 0
-#define BOARD_CU 1
-
-#define VID 0x0403
-#define PID 0x6010
+#include "watch.h"
 
 /*
  * VID:     0x0403
@@ -44,16 +41,6 @@ char ManufacturerIdBuf[16];
 char DescriptionBuf[64];
 char SerialNumberBuf[16];
 
-void erase(struct ftdi_context *ftdi) {
-  fprintf(stdout, "Erasing... ");
-
-  if (0 > ftdi_erase_eeprom(ftdi)) {
-    fprintf(stdout, "Erase failed: %s\n", ftdi_get_error_string(ftdi));
-    return;
-  }
-  fprintf(stdout, "Done.\n");
-}
-
 bool program_device(struct ftdi_context *ftdi, unsigned int device_num,
                     bool au) {
 
@@ -71,102 +58,46 @@ bool program_device(struct ftdi_context *ftdi, unsigned int device_num,
     return false;
   }
 
-  erase(ftdi);
-
-  if (au) {
-    ftdi_eeprom_initdefaults(ftdi, "Alchitry", "Alchitry Au", "FT3KRFFN");
-  } else {
-    ftdi_eeprom_initdefaults(ftdi, "Alchitry", "Alchitry Cu", "FT3WSDT8");
-  }
-  ftdi_set_eeprom_value(ftdi, VENDOR_ID, 0x0403);
-  ftdi_set_eeprom_value(ftdi, PRODUCT_ID, 0x6010);
-  ftdi_set_eeprom_value(ftdi, RELEASE_NUMBER, 0x700);
-  ftdi_set_eeprom_value(ftdi, MAX_POWER, 500);
-  ftdi_set_eeprom_value(ftdi, CHIP_SIZE, 256);
-  ftdi_set_eeprom_value(ftdi, CHIP_TYPE, 86);
-  ftdi_set_eeprom_value(ftdi, CHANNEL_A_TYPE, CHANNEL_IS_FIFO);
-  ftdi_set_eeprom_value(ftdi, CHANNEL_B_TYPE, CHANNEL_IS_UART);
-  ftdi_set_eeprom_value(ftdi, CHANNEL_B_DRIVER, DRIVER_VCP);
-
-  fprintf(stdout, "Programming... ");
-  ftdi_eeprom_build(ftdi);
-  if (0 > ftdi_write_eeprom(ftdi)) {
-    fprintf(stdout, "writing to EEPROM failed: %s\n",
-            ftdi_get_error_string(ftdi));
-    return false;
-  }
-  fprintf(stdout, "Checking EEPROM...\n");
-  if (0 > ftdi_read_eeprom(ftdi)) {
-    fprintf(stdout, "Reading EEPROM failed: %s\n", ftdi_get_error_string(ftdi));
-    return false;
-  }
-  ftdi_eeprom_decode(ftdi, 1);
-
-  fprintf(stdout, "Done.\n");
+  bool ok = board_provision(ftdi, au ? BOARD_AU : BOARD_CU, NULL);
   ftdi_usb_close(ftdi);
 
-  return true;
+  return ok;
 }
 
 void print_devices(struct ftdi_context *ftdi) {
-  int i = 0;
-  char mfg[32], desc[64], ser[16];
-  struct ftdi_device_list *devlist = NULL, *dev;
+  struct board_info *boards;
+  int n = boards_scan(ftdi, &boards);
 
-  if (ftdi_usb_find_all(ftdi, &devlist, VID, PID) < 0) {
-    fprintf(stderr, "Error getting device list!\n");
-  }
-
-  dev = devlist;
-  if (!dev) {
+  if (n == 0)
     fprintf(stdout, "No devices found!\n");
-    return;
-  }
-
-  while (dev) {
-    ftdi_usb_get_strings(ftdi, dev->dev, mfg, sizeof(mfg), desc, sizeof(desc),
-                         ser, sizeof(ser));
-    fprintf(stdout, "%d: %s|%s|%s\n", i, mfg, desc, ser);
-    i++;
-    dev = dev->next;
+  for (int i = 0; i < n; i++) {
+    fprintf(stdout, "%d: %s|%s|%s|%s\n", i, boards[i].mfg, boards[i].desc,
+            boards[i].serial, boards[i].path);
   }
-
-  ftdi_list_free(&devlist);
+  free(boards);
 }
 
-int get_device_type(struct ftdi_context *ftdi, unsigned int device_num) {
-  int i = 0, board = BOARD_ERROR;
-  char mfg[32], desc[64], ser[16];
-  struct ftdi_device_list *devlist = NULL, *dev;
+// Frequency in Hz with an optional k or M suffix
+bool parse_freq(const char *arg, double *freq) {
+  char *end;
+  double f = strtod(arg, &end);
 
-  if (ftdi_usb_find_all(ftdi, &devlist, VID, PID) < 0) {
-    fprintf(stderr, "Error getting device list!\n");
-  }
-
-  dev = devlist;
-  if (!dev) {
-    fprintf(stdout, "No devices found!\n");
-    return board;
-  }
-
-  while (dev) {
-    if (i == device_num) {
-      ftdi_usb_get_strings(ftdi, dev->dev, mfg, sizeof(mfg), desc, sizeof(desc),
-                           ser, sizeof(ser));
-      if (strcmp(desc, "Alchitry Au") == 0) {
-        board = BOARD_AU;
-      } else if (strcmp(desc, "Alchitry Cu") == 0) {
-        board = BOARD_CU;
-      } else {
-        board = BOARD_UNKNOWN;
-      }
-    }
-    i++;
-    dev = dev->next;
+  if (end == arg)
+    return false;
+  if (*end == 'k' || *end == 'K') {
+    f *= 1e3;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    f *= 1e6;
+    end++;
   }
-  ftdi_list_free(&devlist);
+  if (*end != 0 && strcasecmp(end, "Hz") != 0)
+    return false;
+  if (f <= 0)
+    return false;
 
-  return board;
+  *freq = f;
+  return true;
 }
 
 void print_usage() {
@@ -178,9 +109,61 @@ void print_usage() {
   fprintf(stdout, "  -u : write FTDI eeprom\n");
   fprintf(stdout, "  -h : print this help message\n");
   fprintf(stdout, "  -f config.bin : write FPGA flash\n");
+  fprintf(stdout, "  -i : only rewrite changed flash sectors (Cu)\n");
+  fprintf(stdout, "  -v config.bin : verify FPGA flash (Cu) or configuration "
+                  "(Au) against config.bin\n");
+  fprintf(stdout, "  -m mask.msk : bits to ignore when verifying (Au)\n");
+  fprintf(stdout, "  -d dump.bin : read FPGA flash into dump.bin (Cu)\n");
   fprintf(stdout, "  -r config.bin : write FPGA RAM\n");
+  fprintf(stdout, "  -s flow.svf : play an SVF or XSVF file (Au)\n");
   fprintf(stdout, "  -p loader.bin : Au bridge bin\n");
-  fprintf(stdout, "  -b n : select board \"n\" (defaults to 0)\n");
+  fprintf(stdout, "  -c freq|auto : Au TCK while configuring (default 10M),\n"
+                  "                 auto finds the fastest reliable one\n");
+  fprintf(stdout, "  -C freq : Au TCK while writing flash (default 1.5M)\n");
+  fprintf(stdout, "  -b board : select a board by -l number, serial or USB "
+                  "path (default 0)\n");
+  fprintf(stdout, "  -a : program all connected boards in parallel\n");
+  fprintf(stdout, "  -D : keep boards open and run the jobs of later "
+                  "invocations\n");
+  fprintf(stdout, "  -w : run the job (and -u) on every board plugged in "
+                  "from now on,\n"
+                  "       -u also sets up blank FTDIs as the -t au|cu "
+                  "board\n");
+  fprintf(stdout, "  -j n : boards -w programs at once (default %d)\n",
+          WATCH_WORKERS);
+}
+
+// Program every connected board at once
+int program_all(struct ftdi_context *ftdi, const struct options *opt) {
+  struct board_info *found;
+  int n, i;
+
+  if ((n = boards_scan(ftdi, &found)) < 0)
+    return 2;
+  if (n == 0) {
+    fprintf(stdout, "No devices found!\n");
+    free(found);
+    return 2;
+  }
+
+  struct session *sessions = calloc(n, sizeof(struct session));
+  if (sessions == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    free(found);
+    return 2;
+  }
+  for (i = 0; i < n; i++) {
+    sessions[i].index = i;
+    sessions[i].info = found[i];
+  }
+  free(found);
+
+  bool ok = session_run_all(sessions, n, opt);
+
+  for (i = 0; i < n; i++)
+    session_close(&sessions[i]);
+  free(sessions);
+  return ok ? 0 : 2;
 }
 
 int main(int argc, char *argv[]) {
@@ -190,18 +173,37 @@ int main(int argc, char *argv[]) {
   }
 
   int i = 0;
-  bool fpga_flash = false, fpga_ram = false, eeprom = false;
-  bool erase = false, list = false, print = false;
-  bool bridge_provided = false, is_au = false;
-  char *fpga_bin_flash, *fpga_bin_ram, *au_bridge_bin;
-  int device_num = 0;
+  bool eeprom = false, list = false, print = false, all = false;
+  bool serve = false, watch = false;
+  unsigned int workers = WATCH_WORKERS;
+  bool is_au = false;
+  struct options opt = {.config_freq = LOADER_CONFIG_FREQ,
+                        .bridge_freq = LOADER_BRIDGE_FREQ};
+  int device_num = 0, ret = 0;
+  const char *board_key = "0";
 
   struct ftdi_context *ftdi;
 
-  while ((i = getopt(argc, argv, "elhf:r:ub:p:t:")) != -1) {
+  while ((i = getopt(argc, argv, "aDelhf:ir:ub:p:t:v:m:d:s:c:C:wj:")) != -1) {
     switch (i) {
+    case 'a':
+      all = true;
+      break;
+    case 'D':
+      serve = true;
+      break;
+    case 'w':
+      watch = true;
+      break;
+    case 'j':
+      workers = strtoul(optarg, NULL, 10);
+      if (workers == 0) {
+        fprintf(stdout, "Invalid worker count '%s'\n", optarg);
+        print = true;
+      }
+      break;
     case 'e':
-      erase = true;
+      opt.erase = true;
       break;
     case 'l':
       list = true;
@@ -210,22 +212,54 @@ int main(int argc, char *argv[]) {
       print = true;
       break;
     case 'f':
-      fpga_flash = true;
-      fpga_bin_flash = optarg;
+      opt.fpga_flash = true;
+      opt.fpga_bin_flash = optarg;
+      break;
+    case 'i':
+      opt.incremental = true;
       break;
     case 'r':
-      fpga_ram = true;
-      fpga_bin_ram = optarg;
+      opt.fpga_ram = true;
+      opt.fpga_bin_ram = optarg;
       break;
     case 'u':
       eeprom = true;
       break;
+    case 'v':
+      opt.fpga_verify = true;
+      opt.fpga_bin_verify = optarg;
+      break;
+    case 'm':
+      opt.mask_file = optarg;
+      break;
+    case 'd':
+      opt.fpga_dump = true;
+      opt.fpga_bin_dump = optarg;
+      break;
+    case 's':
+      opt.svf = true;
+      opt.svf_file = optarg;
+      break;
     case 'b':
       device_num = strtol(optarg, NULL, 10);
+      board_key = optarg;
       break;
     case 'p':
-      bridge_provided = true;
-      au_bridge_bin = optarg;
+      opt.au_bridge_bin = optarg;
+      break;
+    case 'c':
+      if (strcasecmp(optarg, "auto") == 0) {
+        opt.tune = true;
+      } else if (!parse_freq(optarg, &opt.config_freq)) {
+        fprintf(stdout, "Invalid frequency '%s'\n", optarg);
+        print = true;
+      }
+      break;
+    case 'C':
+      if (!parse_freq(optarg, &opt.bridge_freq)) {
+        fprintf(stdout, "Invalid frequency '%s'\n", optarg);
+        print = true;
+      }
       break;
     case 't':
       if (0 == strcasecmp(optarg, "au")) {
@@ -248,6 +282,23 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
+  if (serve)
+    return daemon_serve(daemon_socket_path());
+
+  if (watch) {
+    if (!eeprom && !opt.erase && !opt.fpga_flash && !opt.fpga_ram &&
+        !opt.fpga_verify && !opt.fpga_dump && !opt.svf) {
+      fprintf(stdout, "Nothing to do with the boards -w sees!\n");
+      print_usage();
+      return 1;
+    }
+    struct watch_job job = {.opt = opt,
+                            .eeprom = eeprom,
+                            .blank_type = is_au ? BOARD_AU : BOARD_CU,
+                            .workers = workers};
+    return watch_run(&job);
+  }
+
   if ((ftdi = ftdi_new()) == 0) {
     fprintf(stderr, "Failed to allocate ftdi structure :%s \n",
         ftdi_get_error_string(ftdi));
@@ -266,83 +317,37 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  if (erase || fpga_flash || fpga_ram) {
-    int board_type = get_device_type(ftdi, device_num);
-    ftdi_usb_open(ftdi, VID, PID);
-    if (board_type == BOARD_AU) {
-      if (bridge_provided == false && (erase || fpga_flash)) {
-        fprintf(stderr, "No Au bridge bin provided!\n");
-        return 2;
-      }
-      struct jtag_ctx *jtag = jtag_new(ftdi);
-      if (jtag_initialize(jtag) == false) {
-        fprintf(stderr, "Failed to initialize JTAG!\n");
-        return 2;
-      }
-      struct loader_ctx *loader = loader_new(jtag);
-
-      /*
-      if (!loader_check_IDCODE(loader)) {
-        fprintf(stderr, "IDCODE check failed!\n");
-        return 2;
-      }
-      */
-
-      if (erase) {
-        if (!loader_erase_flash(loader, au_bridge_bin)) {
-          fprintf(stderr, "Failed to erase flash!\n");
-          return 2;
-        }
-      }
-
-      if (fpga_flash) {
-        if (!loader_write_bin(loader, fpga_bin_flash, true, au_bridge_bin)) {
-          fprintf(stderr, "Failed to write FPGA flash!\n");
-          return 2;
-        }
-      }
-
-      if (fpga_ram) {
-        if (!loader_write_bin(loader, fpga_bin_ram, false, NULL)) {
-          fprintf(stderr, "Failed to write FPGA RAM!\n");
-          return 2;
-        }
-      }
-
-      jtag_shutdown(jtag);
-      free(loader);
-    } else if (board_type == BOARD_CU) {
-      struct spi_ctx *spi = spi_new(ftdi);
-      if (spi_initialize(spi) == false) {
-        fprintf(stderr, "Failed to initialize SPI!\n");
-        return 2;
-      }
-
-      if (erase) {
-        if (!spi_erase_flash(spi)) {
-          fprintf(stderr, "Failed to erase flash!\n");
-        } else {
-          fprintf(stdout, "Done.\n");
-        }
-      }
-
-      if (fpga_flash) {
-        if (!spi_write_bin(spi, fpga_bin_flash)) {
-          fprintf(stderr, "Failed to write FPGA flash!\n");
-        }
-      }
-
-      if (fpga_ram) {
-        fprintf(stderr, "Alchitry Cu doesn't support RAM only programming!\n");
-      }
+  if (opt.erase || opt.fpga_flash || opt.fpga_ram || opt.fpga_verify ||
+      opt.fpga_dump || opt.svf) {
+    // A running daemon already has the boards open, hand the job to it
+    ret = daemon_submit(daemon_socket_path(), board_key, all, &opt);
+    if (ret >= 0) {
+      ftdi_free(ftdi);
+      return ret;
+    }
 
-      spi_shutdown(spi);
+    if (all) {
+      ret = program_all(ftdi, &opt);
     } else {
-      fprintf(stderr, "Unknown board type!\n");
-      return 2;
+      struct board_info *found;
+      int n = boards_scan(ftdi, &found);
+      int index = n > 0 ? board_find(found, n, board_key) : -1;
+
+      if (n == 0) {
+        fprintf(stdout, "No devices found!\n");
+        ret = 2;
+      } else if (index < 0) {
+        fprintf(stderr, "Board %s not found!\n", board_key);
+        ret = 2;
+      } else {
+        struct session s = {.index = index, .info = found[index]};
+        ret = session_run(&s, &opt) ? 0 : 2;
+        session_close(&s);
+      }
+      free(found);
     }
-    ftdi_usb_close(ftdi);
   }
   ftdi_free(ftdi);
-  return 0;
+  image_cache_clear();
+  return ret;
 }
@@ -0,0 +1,126 @@
+#include "bitrev.h"
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BITREV_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define BITREV_NEON
+#include <arm_neon.h>
+#endif
+
+#define R2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define R4(n) R2(n), R2(n + 2 * 16), R2(n + 1 * 16), R2(n + 3 * 16)
+#define R6(n) R4(n), R4(n + 2 * 4), R4(n + 1 * 4), R4(n + 3 * 4)
+
+const uint8_t bitrev_table[256] = {R6(0), R6(2), R6(1), R6(3)};
+
+static void bitrev_select(uint8_t *dst, const uint8_t *src, size_t n);
+static void bitrev_table_copy(uint8_t *dst, const uint8_t *src, size_t n);
+
+static void bitrev_pick(void);
+
+static void (*bitrev_impl)(uint8_t *, const uint8_t *, size_t) = bitrev_select;
+static pthread_once_t bitrev_once = PTHREAD_ONCE_INIT;
+
+void bitrev_table_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = bitrev_table[src[i]];
+}
+
+#ifdef BITREV_X86
+// Each nibble is reversed with a 16 entry table lookup (pshufb) and the
+// two halves swapped
+#define NIBBLE_REV                                                             \
+  0x00, 0x08, 0x04, 0x0C, 0x02, 0x0A, 0x06, 0x0E, 0x01, 0x09, 0x05, 0x0D,      \
+      0x03, 0x0B, 0x07, 0x0F
+#define NIBBLE_REV_HI                                                          \
+  0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0,      \
+      0x30, 0xB0, 0x70, 0xF0
+
+__attribute__((target("ssse3"))) static void
+bitrev_ssse3_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  const __m128i lo_tbl = _mm_setr_epi8(NIBBLE_REV_HI);
+  const __m128i hi_tbl = _mm_setr_epi8(NIBBLE_REV);
+  const __m128i mask = _mm_set1_epi8(0x0F);
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    v = _mm_or_si128(_mm_shuffle_epi8(lo_tbl, lo),
+                     _mm_shuffle_epi8(hi_tbl, hi));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+  bitrev_table_copy(dst + i, src + i, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+bitrev_avx2_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  const __m256i lo_tbl = _mm256_setr_epi8(NIBBLE_REV_HI, NIBBLE_REV_HI);
+  const __m256i hi_tbl = _mm256_setr_epi8(NIBBLE_REV, NIBBLE_REV);
+  const __m256i mask = _mm256_set1_epi8(0x0F);
+  size_t i = 0;
+
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    __m256i lo = _mm256_and_si256(v, mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    v = _mm256_or_si256(_mm256_shuffle_epi8(lo_tbl, lo),
+                        _mm256_shuffle_epi8(hi_tbl, hi));
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  bitrev_table_copy(dst + i, src + i, n - i);
+}
+#endif
+
+#ifdef BITREV_NEON
+static void bitrev_neon_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  size_t i = 0;
+
+  for (; i + 16 <= n; i += 16)
+    vst1q_u8(dst + i, vrbitq_u8(vld1q_u8(src + i)));
+  bitrev_table_copy(dst + i, src + i, n - i);
+}
+#endif
+
+int bitrev_kernels(const struct bitrev_kernel **kernels) {
+  static struct bitrev_kernel list[3];
+  int n = 0;
+
+  list[n++] = (struct bitrev_kernel){"table", bitrev_table_copy};
+#ifdef BITREV_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3"))
+    list[n++] = (struct bitrev_kernel){"ssse3", bitrev_ssse3_copy};
+  if (__builtin_cpu_supports("avx2"))
+    list[n++] = (struct bitrev_kernel){"avx2", bitrev_avx2_copy};
+#endif
+#ifdef BITREV_NEON
+  list[n++] = (struct bitrev_kernel){"neon", bitrev_neon_copy};
+#endif
+
+  *kernels = list;
+  return n;
+}
+
+void bitrev_pick(void) {
+  const struct bitrev_kernel *kernels;
+  int count = bitrev_kernels(&kernels);
+
+  bitrev_impl = kernels[count - 1].copy;
+}
+
+// Picks the fastest kernel on the first call, once even when several boards
+// make that call at the same time
+void bitrev_select(uint8_t *dst, const uint8_t *src, size_t n) {
+  pthread_once(&bitrev_once, bitrev_pick);
+  bitrev_impl(dst, src, n);
+}
+
+void bitrev_copy(uint8_t *dst, const uint8_t *src, size_t n) {
+  bitrev_impl(dst, src, n);
+}
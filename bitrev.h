@@ -0,0 +1,30 @@
+#ifndef BITREV_H_
+#define BITREV_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const uint8_t bitrev_table[256];
+
+struct bitrev_kernel {
+  const char *name;
+  void (*copy)(uint8_t *dst, const uint8_t *src, size_t n);
+};
+
+// Reverse the bit order of each byte, dst may be the same as src
+void bitrev_copy(uint8_t *dst, const uint8_t *src, size_t n);
+
+// Kernels usable on this CPU, from the portable one to the one
+// bitrev_copy() picks
+int bitrev_kernels(const struct bitrev_kernel **kernels);
+
+static inline uint8_t bitrev_byte(uint8_t b) { return bitrev_table[b]; }
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BITREV_H_ */
@@ -0,0 +1,54 @@
+#include "bitrev.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_SIZE (4 * 1024 * 1024)
+#define BENCH_ROUNDS 50
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+  uint8_t *src = malloc(BENCH_SIZE), *dst = malloc(BENCH_SIZE);
+  const struct bitrev_kernel *kernels;
+  int count = bitrev_kernels(&kernels);
+  int ret = 0;
+
+  if (src == NULL || dst == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return 1;
+  }
+
+  srand(1);
+  for (int i = 0; i < BENCH_SIZE; i++)
+    src[i] = rand();
+
+  fprintf(stdout, "Reversing %d MB x %d\n", BENCH_SIZE >> 20, BENCH_ROUNDS);
+  for (int k = 0; k < count; k++) {
+    memset(dst, 0, BENCH_SIZE);
+    double start = now();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+      kernels[k].copy(dst, src, BENCH_SIZE - (r & 7));
+    double t = now() - start;
+
+    bool ok = true;
+    for (int i = 0; i < BENCH_SIZE - 7; i++)
+      ok &= dst[i] == bitrev_byte(src[i]);
+    if (!ok)
+      ret = 1;
+
+    fprintf(stdout, "%-6s %8.1f MB/s%s\n", kernels[k].name,
+            (double)BENCH_SIZE * BENCH_ROUNDS / t / 1e6,
+            ok ? "" : "  WRONG RESULT");
+  }
+
+  free(src);
+  free(dst);
+  return ret;
+}
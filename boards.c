@@ -0,0 +1,395 @@
+#include "boards.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_FILE "boards"
+#define MAX_PORTS 7 // USB allows no deeper hub chains
+#define BOOT_ID "/proc/sys/kernel/random/boot_id"
+#ifndef USB_SYSFS
+#define USB_SYSFS "/sys/bus/usb/devices"
+#endif
+
+static bool boot_id(char *id, size_t len);
+static unsigned long long device_instance(const char *path);
+static bool cache_path(char *path, size_t len, bool create);
+static int cache_load(struct board_info **cached);
+static void cache_save(const struct board_info *boards, int n);
+static bool read_strings(struct ftdi_context *ftdi, libusb_device *dev,
+                         struct board_info *board);
+static int board_type(const char *desc);
+static void eeprom_erase(struct ftdi_context *ftdi);
+
+// Device addresses start over after a reboot, so the cache only holds for
+// the boot it was written in
+bool boot_id(char *id, size_t len) {
+  FILE *fp = fopen(BOOT_ID, "r");
+  bool ok = fp && fgets(id, len, fp) && *id;
+
+  if (fp)
+    fclose(fp);
+  if (ok)
+    id[strcspn(id, "\n")] = 0;
+  return ok;
+}
+
+// The kernel gives the device a new sysfs directory every time it's
+// enumerated, so its inode tells a board plugged in again from the one
+// before even when the address wrapped around to the same one. 0 when
+// there's no sysfs to ask.
+unsigned long long device_instance(const char *path) {
+  char dir[PATH_MAX];
+  struct stat st;
+
+  snprintf(dir, sizeof(dir), "%s/%s", USB_SYSFS, path);
+  return stat(dir, &st) == 0 ? (unsigned long long)st.st_ino : 0;
+}
+
+// A "boot <boot_id>" line, then one tab separated "path address instance
+// manufacturer description serial" line per board
+bool cache_path(char *path, size_t len, bool create) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int n;
+
+  if (xdg && *xdg)
+    n = snprintf(path, len, "%s/alchitry_loader", xdg);
+  else if (home && *home)
+    n = snprintf(path, len, "%s/.cache/alchitry_loader", home);
+  else
+    return false;
+  if (n < 0 || (size_t)n >= len)
+    return false;
+
+  if (create) {
+    // Create each missing directory along the way
+    for (char *p = path + 1; *p; p++) {
+      if (*p == '/') {
+        *p = 0;
+        mkdir(path, 0755);
+        *p = '/';
+      }
+    }
+    mkdir(path, 0755);
+  }
+
+  n = snprintf(path + n, len - n, "/%s", CACHE_FILE);
+  return n > 0 && (size_t)n < len;
+}
+
+int cache_load(struct board_info **cached) {
+  char path[PATH_MAX], line[256], boot[64], cached_boot[64];
+  struct board_info *list = NULL, b;
+  int n = 0, size = 0;
+  FILE *fp;
+
+  *cached = NULL;
+  if (!boot_id(boot, sizeof(boot)) || !cache_path(path, sizeof(path), false) ||
+      (fp = fopen(path, "r")) == NULL)
+    return 0;
+
+  // Written in another boot, or by an older loader
+  if (!fgets(line, sizeof(line), fp) ||
+      sscanf(line, "boot %63s", cached_boot) != 1 ||
+      strcmp(boot, cached_boot) != 0) {
+    fclose(fp);
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    memset(&b, 0, sizeof(b));
+    if (sscanf(line, "%31[^\t]\t%hhu\t%llu\t%31[^\t]\t%63[^\t]\t%15[^\n]",
+               b.path, &b.address, &b.instance, b.mfg, b.desc,
+               b.serial) != 6)
+      continue;
+    if (n == size) {
+      size = size ? size * 2 : 16;
+      struct board_info *p = realloc(list, size * sizeof(*list));
+      if (p == NULL)
+        break;
+      list = p;
+    }
+    b.type = board_type(b.desc);
+    list[n++] = b;
+  }
+
+  fclose(fp);
+  *cached = list;
+  return n;
+}
+
+void cache_save(const struct board_info *boards, int n) {
+  char path[PATH_MAX], tmp[PATH_MAX + 16], boot[64];
+
+  if (!boot_id(boot, sizeof(boot)) || !cache_path(path, sizeof(path), true))
+    return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL)
+    return;
+  fprintf(out, "boot %s\n", boot);
+  for (int i = 0; i < n; i++) {
+    fprintf(out, "%s\t%u\t%llu\t%s\t%s\t%s\n", boards[i].path,
+            boards[i].address, boards[i].instance, boards[i].mfg,
+            boards[i].desc, boards[i].serial);
+  }
+  // Only a cache, another run will simply read the strings again
+  if (fclose(out) != 0 || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
+// The bus and port chain a device is plugged into, as in sysfs
+void board_path(libusb_device *dev, char *path, size_t len) {
+  uint8_t ports[MAX_PORTS];
+  int n = libusb_get_port_numbers(dev, ports, MAX_PORTS);
+  int pos = snprintf(path, len, "%u", libusb_get_bus_number(dev));
+
+  for (int i = 0; i < n && pos > 0 && (size_t)pos < len; i++)
+    pos += snprintf(path + pos, len - pos, "%c%u", i == 0 ? '-' : '.',
+                    ports[i]);
+}
+
+// A chip without a serial string descriptor has none to read, asking for it
+// anyway fails the whole read
+bool read_strings(struct ftdi_context *ftdi, libusb_device *dev,
+                  struct board_info *board) {
+  struct libusb_device_descriptor desc;
+  bool serial = libusb_get_device_descriptor(dev, &desc) < 0 ||
+                desc.iSerialNumber != 0;
+
+  return ftdi_usb_get_strings(ftdi, dev, board->mfg, sizeof(board->mfg),
+                              board->desc, sizeof(board->desc),
+                              serial ? board->serial : NULL,
+                              sizeof(board->serial)) >= 0;
+}
+
+int board_type(const char *desc) {
+  if (strcmp(desc, "Alchitry Au") == 0)
+    return BOARD_AU;
+  if (strcmp(desc, "Alchitry Cu") == 0)
+    return BOARD_CU;
+  return BOARD_UNKNOWN;
+}
+
+const char *board_name(int type) {
+  switch (type) {
+  case BOARD_AU:
+    return "Alchitry Au";
+  case BOARD_CU:
+    return "Alchitry Cu";
+  default:
+    return "unknown board";
+  }
+}
+
+// Whether the FTDI has never been set up as anything: its EEPROM is erased
+// or still holds the FT2232H defaults, neither of which has a serial. Only
+// these are safe to turn into an Au or Cu, anything else is some other
+// vendor's device.
+bool board_blank(const struct board_info *board) {
+  if (*board->serial)
+    return false;
+  if (*board->mfg == 0 && *board->desc == 0)
+    return true;
+  return strcmp(board->mfg, "FTDI") == 0 &&
+         strcmp(board->desc, "Dual RS232-HS") == 0;
+}
+
+// What tells this board apart from the others for settings kept between
+// runs: its serial when it was given its own, otherwise the USB path it's
+// plugged into
+const char *board_key(const struct board_info *board) {
+  if (board->serial[0] && strcmp(board->serial, AU_SERIAL) != 0 &&
+      strcmp(board->serial, CU_SERIAL) != 0)
+    return board->serial;
+  return board->path;
+}
+
+// List the connected boards. Reading a device's strings takes a round trip
+// to it, so they're only read for devices the cache can't vouch for: ones
+// it doesn't have with the same path, address and instance in this boot.
+// Without sysfs there's no telling a board plugged in again from the one
+// before, so the strings are always read. The cache is rewritten only when
+// the set of devices changed.
+int boards_scan(struct ftdi_context *ftdi, struct board_info **boards) {
+  struct ftdi_device_list *devlist = NULL, *dev;
+  struct board_info *cached, *list;
+  int n, n_cached, i = 0;
+
+  *boards = NULL;
+  if ((n = ftdi_usb_find_all(ftdi, &devlist, VID, PID)) < 0) {
+    fprintf(stderr, "Error getting device list!\n");
+    return -1;
+  }
+
+  list = calloc(n > 0 ? n : 1, sizeof(*list));
+  if (list == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    ftdi_list_free(&devlist);
+    return -1;
+  }
+
+  n_cached = cache_load(&cached);
+  bool changed = n != n_cached;
+  for (dev = devlist; dev && i < n; dev = dev->next, i++) {
+    struct board_info *b = &list[i];
+    int j;
+
+    board_path(dev->dev, b->path, sizeof(b->path));
+    b->address = libusb_get_device_address(dev->dev);
+    b->instance = device_instance(b->path);
+    for (j = 0; b->instance != 0 && j < n_cached; j++) {
+      if (board_same(&cached[j], b))
+        break;
+    }
+
+    if (b->instance != 0 && j < n_cached) {
+      *b = cached[j];
+    } else {
+      read_strings(ftdi, dev->dev, b);
+      b->type = board_type(b->desc);
+      changed = true;
+    }
+  }
+  ftdi_list_free(&devlist);
+
+  if (changed)
+    cache_save(list, i);
+  free(cached);
+
+  *boards = list;
+  return i;
+}
+
+// Look a board up by its place in the list, its USB path or its serial
+int board_find(const struct board_info *boards, int n, const char *key) {
+  char *end;
+  long index = strtol(key, &end, 10);
+
+  if (end != key && *end == 0)
+    return index >= 0 && index < n ? index : -1;
+
+  for (int i = 0; i < n; i++) {
+    if (strcmp(boards[i].path, key) == 0)
+      return i;
+  }
+  for (int i = 0; i < n; i++) {
+    if (strcmp(boards[i].serial, key) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// Whether two board_infos are the same plugging in of the same device
+bool board_same(const struct board_info *a, const struct board_info *b) {
+  return a->address == b->address && a->instance == b->instance &&
+         strcmp(a->path, b->path) == 0;
+}
+
+// Open board on ftdi, matching the device by path, address and instance
+// alone so no other device is touched
+bool board_open(struct ftdi_context *ftdi, const struct board_info *board) {
+  struct ftdi_device_list *devlist = NULL, *dev;
+  struct board_info live;
+  bool ok = false;
+
+  if (ftdi_usb_find_all(ftdi, &devlist, VID, PID) < 0) {
+    fprintf(stderr, "Error getting device list!\n");
+    return false;
+  }
+
+  for (dev = devlist; dev; dev = dev->next) {
+    board_path(dev->dev, live.path, sizeof(live.path));
+    live.address = libusb_get_device_address(dev->dev);
+    live.instance = device_instance(live.path);
+    if (board_same(&live, board))
+      break;
+  }
+
+  if (dev == NULL) {
+    fprintf(stderr, "Board at %s is gone!\n", board->path);
+  } else if (ftdi_usb_open_dev(ftdi, dev->dev) < 0) {
+    fprintf(stderr, "Failed to open board at %s: %s\n", board->path,
+            ftdi_get_error_string(ftdi));
+  } else {
+    ok = true;
+  }
+
+  ftdi_list_free(&devlist);
+  return ok;
+}
+
+// Read the strings of a device that just showed up. Unlike boards_scan()
+// this always asks the device, a board plugged in again may well be
+// another one.
+bool board_identify(struct ftdi_context *ftdi, libusb_device *dev,
+                    struct board_info *board) {
+  memset(board, 0, sizeof(*board));
+  board_path(dev, board->path, sizeof(board->path));
+  board->address = libusb_get_device_address(dev);
+  board->instance = device_instance(board->path);
+
+  if (!read_strings(ftdi, dev, board)) {
+    fprintf(stderr, "Failed to read the strings of the device at %s: %s\n",
+            board->path, ftdi_get_error_string(ftdi));
+    board->type = BOARD_ERROR;
+    return false;
+  }
+  board->type = board_type(board->desc);
+  return true;
+}
+
+void eeprom_erase(struct ftdi_context *ftdi) {
+  fprintf(stdout, "Erasing... ");
+
+  if (0 > ftdi_erase_eeprom(ftdi)) {
+    fprintf(stdout, "Erase failed: %s\n", ftdi_get_error_string(ftdi));
+    return;
+  }
+  fprintf(stdout, "Done.\n");
+}
+
+// Write the FTDI EEPROM of the open board on ftdi so it comes up as an Au or
+// Cu, keeping serial unless it's NULL or empty. The new strings only show
+// once the board is plugged in again.
+bool board_provision(struct ftdi_context *ftdi, int type, const char *serial) {
+  bool au = type == BOARD_AU;
+
+  if (serial == NULL || *serial == 0)
+    serial = au ? AU_SERIAL : CU_SERIAL;
+
+  eeprom_erase(ftdi);
+
+  ftdi_eeprom_initdefaults(ftdi, "Alchitry",
+                           au ? "Alchitry Au" : "Alchitry Cu", (char *)serial);
+  ftdi_set_eeprom_value(ftdi, VENDOR_ID, VID);
+  ftdi_set_eeprom_value(ftdi, PRODUCT_ID, PID);
+  ftdi_set_eeprom_value(ftdi, RELEASE_NUMBER, 0x700);
+  ftdi_set_eeprom_value(ftdi, MAX_POWER, 500);
+  ftdi_set_eeprom_value(ftdi, CHIP_SIZE, 256);
+  ftdi_set_eeprom_value(ftdi, CHIP_TYPE, 86);
+  ftdi_set_eeprom_value(ftdi, CHANNEL_A_TYPE, CHANNEL_IS_FIFO);
+  ftdi_set_eeprom_value(ftdi, CHANNEL_B_TYPE, CHANNEL_IS_UART);
+  ftdi_set_eeprom_value(ftdi, CHANNEL_B_DRIVER, DRIVER_VCP);
+
+  fprintf(stdout, "Programming... ");
+  ftdi_eeprom_build(ftdi);
+  if (0 > ftdi_write_eeprom(ftdi)) {
+    fprintf(stdout, "writing to EEPROM failed: %s\n",
+            ftdi_get_error_string(ftdi));
+    return false;
+  }
+  fprintf(stdout, "Checking EEPROM...\n");
+  if (0 > ftdi_read_eeprom(ftdi)) {
+    fprintf(stdout, "Reading EEPROM failed: %s\n", ftdi_get_error_string(ftdi));
+    return false;
+  }
+  ftdi_eeprom_decode(ftdi, 1);
+
+  fprintf(stdout, "Done.\n");
+  return true;
+}
@@ -0,0 +1,53 @@
+#ifndef BOARDS_H_
+#define BOARDS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ftdi.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BOARD_ERROR -2
+#define BOARD_UNKNOWN -1
+#define BOARD_AU 0
+#define BOARD_CU 1
+
+#define VID 0x0403
+#define PID 0x6010
+
+// Every board leaves the factory with the same serial
+#define AU_SERIAL "FT3KRFFN"
+#define CU_SERIAL "FT3WSDT8"
+
+// A connected board. Its strings come from the enumeration cache in
+// $XDG_CACHE_HOME/alchitry_loader/boards (or ~/.cache/...) as long as the
+// same plugging in of the device is still there, see board_same().
+struct board_info {
+  int type;
+  char mfg[32];
+  char desc[64];
+  char serial[16];
+  char path[32]; // bus-port.port... as in sysfs
+  uint8_t address;
+  unsigned long long instance; // new for every enumeration, 0 if unknown
+};
+
+int boards_scan(struct ftdi_context *ftdi, struct board_info **boards);
+int board_find(const struct board_info *boards, int n, const char *key);
+bool board_same(const struct board_info *a, const struct board_info *b);
+bool board_open(struct ftdi_context *ftdi, const struct board_info *board);
+const char *board_name(int type);
+bool board_blank(const struct board_info *board);
+const char *board_key(const struct board_info *board);
+void board_path(libusb_device *dev, char *path, size_t len);
+bool board_identify(struct ftdi_context *ftdi, libusb_device *dev,
+                    struct board_info *board);
+bool board_provision(struct ftdi_context *ftdi, int type, const char *serial);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* BOARDS_H_ */
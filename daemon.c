@@ -0,0 +1,577 @@
+#define _GNU_SOURCE // struct ucred
+#include "daemon.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "image.h"
+
+/*
+ * Protocol, in host byte order since both ends run on the same machine:
+ *
+ * The client connects and sends a struct job_head followed by the board
+ * key and the file names the head gives the lengths of, none of them NUL
+ * terminated. Its stdout and stderr come along with the head as SCM_RIGHTS
+ * so the job prints to the client's terminal. The daemon runs the job and
+ * answers with a struct job_reply carrying the exit status for it.
+ */
+#define DAEMON_MAGIC 0x52444c41 // "ALDR"
+#define DAEMON_VERSION 1
+#define RECV_TIMEOUT 5 // seconds a client gets to send its job
+
+// The steps of a job, bit i of job_head.flags stands for job_flags[i]
+static const size_t job_flags[] = {
+    offsetof(struct options, erase),     offsetof(struct options, fpga_flash),
+    offsetof(struct options, fpga_ram),  offsetof(struct options, fpga_verify),
+    offsetof(struct options, fpga_dump), offsetof(struct options, svf),
+    offsetof(struct options, incremental), offsetof(struct options, tune),
+};
+#define JOB_FLAGS (sizeof(job_flags) / sizeof(job_flags[0]))
+#define JOB_ALL 0x8000 // every connected board instead of the keyed one
+
+// The files of a job, in the order they follow the board key
+static const size_t job_files[] = {
+    offsetof(struct options, fpga_bin_flash),
+    offsetof(struct options, fpga_bin_ram),
+    offsetof(struct options, fpga_bin_verify),
+    offsetof(struct options, fpga_bin_dump),
+    offsetof(struct options, mask_file),
+    offsetof(struct options, svf_file),
+    offsetof(struct options, au_bridge_bin),
+};
+#define JOB_FILES (sizeof(job_files) / sizeof(job_files[0]))
+
+struct job_head {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  double config_freq;
+  double bridge_freq;
+  uint16_t key_len;
+  uint16_t file_len[JOB_FILES]; // 0 when the file isn't given
+};
+
+struct job_reply {
+  uint32_t magic;
+  int32_t status;
+};
+
+// The boards as of the last job, and a session for each
+struct daemon {
+  struct ftdi_context *ftdi; // for listing the boards
+  struct board_info *found;
+  struct session *sessions;
+  int n;
+};
+
+static bool socket_addr(const char *path, struct sockaddr_un *addr);
+static bool socket_dir(const char *path, bool create);
+static bool peer_is_us(int fd);
+static int daemon_connect(const char *path);
+static bool send_all(int fd, const void *buf, size_t len);
+static bool recv_all(int fd, void *buf, size_t len);
+static bool send_job(int fd, const void *buf, size_t len);
+static bool recv_job(int fd, void *buf, size_t len, int *fds);
+static bool *flag_field(struct options *opt, unsigned int i);
+static char **file_field(struct options *opt, unsigned int i);
+static char *absolute(const char *path);
+static bool daemon_sync(struct daemon *d);
+static int run_job(struct daemon *d, const char *key, bool all,
+                   const struct options *opt);
+static void serve_job(struct daemon *d, int c);
+
+// $XDG_RUNTIME_DIR/alchitry_loader.sock, or a socket in a directory of the
+// user's own in /tmp
+const char *daemon_socket_path(void) {
+  static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  int n;
+
+  if (dir && *dir)
+    n = snprintf(path, sizeof(path), "%s/alchitry_loader.sock", dir);
+  else
+    n = snprintf(path, sizeof(path), "/tmp/alchitry_loader-%u/loader.sock",
+                 (unsigned)getuid());
+  return n > 0 && (size_t)n < sizeof(path) ? path : NULL;
+}
+
+bool socket_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path == NULL || strlen(path) >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path);
+  return true;
+}
+
+// Only a directory no other user can write to keeps others from putting
+// their own socket where ours should be
+bool socket_dir(const char *path, bool create) {
+  char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  struct stat st;
+  char *slash;
+
+  if (path == NULL || strlen(path) >= sizeof(dir))
+    return false;
+  strcpy(dir, path);
+  if ((slash = strrchr(dir, '/')) == NULL)
+    return false;
+  *slash = 0;
+
+  if (create)
+    mkdir(dir, 0700);
+  if (lstat(dir, &st) != 0)
+    return false;
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+      (st.st_mode & 077) != 0) {
+    fprintf(stderr, "%s isn't private to this user, not using it!\n", dir);
+    return false;
+  }
+  return true;
+}
+
+// Jobs carry our terminal and their status is trusted, so both ends have to
+// belong to the same user
+bool peer_is_us(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+int daemon_connect(const char *path) {
+  struct sockaddr_un addr;
+  int fd;
+
+  if (!socket_dir(path, false) || !socket_addr(path, &addr) ||
+      (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  if (!peer_is_us(fd)) {
+    fprintf(stderr, "%s belongs to another user, not using it!\n", path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool send_all(int fd, const void *buf, size_t len) {
+  const char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool recv_all(int fd, void *buf, size_t len) {
+  char *p = buf;
+
+  while (len > 0) {
+    ssize_t n = recv(fd, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Send a job along with our stdout and stderr
+bool send_job(int fd, const void *buf, size_t len) {
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+  struct msghdr msg = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = ctl.buf,
+                       .msg_controllen = sizeof(ctl.buf)};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  ssize_t n;
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  do {
+    n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return false;
+  return send_all(fd, (const char *)buf + n, len - n);
+}
+
+// Receive len bytes of a job, picking up the client's stdout and stderr
+// into fds when they come along
+bool recv_job(int fd, void *buf, size_t len, int *fds) {
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+  } ctl;
+  char *p = buf;
+
+  while (len > 0) {
+    struct iovec iov = {.iov_base = p, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = ctl.buf,
+                         .msg_controllen = sizeof(ctl.buf)};
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      int got[2], count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (count > 2)
+        count = 2;
+      memcpy(got, CMSG_DATA(cmsg), count * sizeof(int));
+      if (count == 2 && fds[0] < 0) {
+        fds[0] = got[0];
+        fds[1] = got[1];
+      } else {
+        for (int i = 0; i < count; i++)
+          close(got[i]);
+      }
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool *flag_field(struct options *opt, unsigned int i) {
+  return (bool *)((char *)opt + job_flags[i]);
+}
+
+char **file_field(struct options *opt, unsigned int i) {
+  return (char **)((char *)opt + job_files[i]);
+}
+
+// The daemon opens the files from its own working directory
+char *absolute(const char *path) {
+  char cwd[PATH_MAX];
+
+  if (path[0] == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+    return strdup(path);
+
+  char *abs = malloc(strlen(cwd) + strlen(path) + 2);
+  if (abs)
+    sprintf(abs, "%s/%s", cwd, path);
+  return abs;
+}
+
+int daemon_submit(const char *path, const char *board_key, bool all,
+                  const struct options *opt) {
+  struct job_head head = {.magic = DAEMON_MAGIC,
+                          .version = DAEMON_VERSION,
+                          .flags = all ? JOB_ALL : 0,
+                          .config_freq = opt->config_freq,
+                          .bridge_freq = opt->bridge_freq};
+  struct options job = *opt;
+  struct job_reply reply;
+  char *files[JOB_FILES] = {NULL}, *buf = NULL;
+  size_t size = sizeof(head) + strlen(board_key);
+  unsigned int i;
+  int fd, ret = 2;
+
+  if ((fd = daemon_connect(path)) < 0)
+    return -1;
+
+  for (i = 0; i < JOB_FLAGS; i++) {
+    if (*flag_field(&job, i))
+      head.flags |= 1 << i;
+  }
+  head.key_len = strlen(board_key);
+  for (i = 0; i < JOB_FILES; i++) {
+    const char *file = *file_field(&job, i);
+    if (file == NULL)
+      continue;
+    if ((files[i] = absolute(file)) == NULL)
+      break;
+    if (strlen(files[i]) > UINT16_MAX)
+      break;
+    head.file_len[i] = strlen(files[i]);
+    size += head.file_len[i];
+  }
+
+  if (i < JOB_FILES || strlen(board_key) > UINT16_MAX ||
+      (buf = malloc(size)) == NULL) {
+    fprintf(stderr, "Failed to build a job for the loader daemon!\n");
+  } else {
+    char *p = buf;
+    memcpy(p, &head, sizeof(head));
+    p += sizeof(head);
+    memcpy(p, board_key, head.key_len);
+    p += head.key_len;
+    for (i = 0; i < JOB_FILES; i++) {
+      memcpy(p, files[i], head.file_len[i]);
+      p += head.file_len[i];
+    }
+
+    // Whatever we printed so far comes before the job's messages
+    fflush(stdout);
+    fflush(stderr);
+    if (!send_job(fd, buf, size)) {
+      fprintf(stderr, "Failed to send the job to the loader daemon!\n");
+    } else if (!recv_all(fd, &reply, sizeof(reply)) ||
+               reply.magic != DAEMON_MAGIC) {
+      fprintf(stderr, "Lost the loader daemon during the job!\n");
+    } else {
+      ret = reply.status;
+    }
+  }
+
+  free(buf);
+  for (i = 0; i < JOB_FILES; i++)
+    free(files[i]);
+  close(fd);
+  return ret;
+}
+
+// Match the open sessions to the boards connected now. Sessions of boards
+// that are gone get closed, new boards get a session opened by their first
+// job.
+bool daemon_sync(struct daemon *d) {
+  struct board_info *found;
+  int n, i, j;
+
+  if ((n = boards_scan(d->ftdi, &found)) < 0)
+    return false;
+
+  struct session *sessions = calloc(n > 0 ? n : 1, sizeof(struct session));
+  if (sessions == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    free(found);
+    return false;
+  }
+
+  for (i = 0; i < n; i++) {
+    struct session *s = &sessions[i];
+    for (j = 0; j < d->n; j++) {
+      struct session *old = &d->sessions[j];
+      if (old->ftdi != NULL && board_same(&old->info, &found[i])) {
+        *s = *old;
+        old->ftdi = NULL;
+        break;
+      }
+    }
+    s->index = i;
+    s->info = found[i];
+  }
+  for (j = 0; j < d->n; j++)
+    session_close(&d->sessions[j]);
+
+  free(d->sessions);
+  free(d->found);
+  d->sessions = sessions;
+  d->found = found;
+  d->n = n;
+  return true;
+}
+
+int run_job(struct daemon *d, const char *key, bool all,
+            const struct options *opt) {
+  if (!daemon_sync(d))
+    return 2;
+  if (d->n == 0) {
+    fprintf(stdout, "No devices found!\n");
+    return 2;
+  }
+  if (all)
+    return session_run_all(d->sessions, d->n, opt) ? 0 : 2;
+
+  int index = board_find(d->found, d->n, key);
+  if (index < 0) {
+    fprintf(stderr, "Board %s not found!\n", key);
+    return 2;
+  }
+  return session_run(&d->sessions[index], opt) ? 0 : 2;
+}
+
+void serve_job(struct daemon *d, int c) {
+  struct job_head head = {0};
+  struct job_reply reply = {.magic = DAEMON_MAGIC, .status = 2};
+  struct timeval timeout = {.tv_sec = RECV_TIMEOUT};
+  struct options opt = {0};
+  char *tail = NULL, *key = NULL;
+  int fds[2] = {-1, -1}, saved[2] = {-1, -1};
+  size_t size = 0, pos;
+  unsigned int i;
+
+  // A client that never sends its job mustn't hold up the others
+  setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  bool ok = recv_job(c, &head, sizeof(head), fds) &&
+            head.magic == DAEMON_MAGIC && head.version == DAEMON_VERSION &&
+            head.config_freq > 0 && head.bridge_freq > 0;
+  if (ok) {
+    size = head.key_len;
+    for (i = 0; i < JOB_FILES; i++)
+      size += head.file_len[i];
+    ok = (tail = malloc(size + 1)) != NULL && recv_all(c, tail, size);
+  }
+  if (ok) {
+    key = strndup(tail, head.key_len);
+    pos = head.key_len;
+    for (i = 0; i < JOB_FILES; i++) {
+      if (head.file_len[i] == 0)
+        continue;
+      *file_field(&opt, i) = strndup(tail + pos, head.file_len[i]);
+      pos += head.file_len[i];
+    }
+    for (i = 0; i < JOB_FLAGS; i++)
+      *flag_field(&opt, i) = (head.flags & (1 << i)) != 0;
+    opt.config_freq = head.config_freq;
+    opt.bridge_freq = head.bridge_freq;
+  }
+
+  if (!ok || key == NULL) {
+    // Another daemon checking whether we're there sends nothing at all
+    if (head.magic != 0)
+      fprintf(stderr, "Dropped a malformed job!\n");
+  } else {
+    bool all = (head.flags & JOB_ALL) != 0;
+
+    // The job prints to the client's terminal
+    fflush(stdout);
+    fflush(stderr);
+    if (fds[0] >= 0) {
+      saved[0] = dup(STDOUT_FILENO);
+      saved[1] = dup(STDERR_FILENO);
+      dup2(fds[0], STDOUT_FILENO);
+      dup2(fds[1], STDERR_FILENO);
+    }
+
+    reply.status = run_job(d, key, all, &opt);
+    // Don't keep every image a job opened mapped, they're opened afresh
+    // by the next job anyway
+    image_cache_clear();
+
+    fflush(stdout);
+    fflush(stderr);
+    if (saved[0] >= 0) {
+      dup2(saved[0], STDOUT_FILENO);
+      dup2(saved[1], STDERR_FILENO);
+      close(saved[0]);
+      close(saved[1]);
+    }
+
+    fprintf(stdout, "Job for %s: %s\n", all ? "all boards" : key,
+            reply.status == 0 ? "done" : "FAILED");
+    send_all(c, &reply, sizeof(reply));
+  }
+
+  for (i = 0; i < JOB_FILES; i++)
+    free(*file_field(&opt, i));
+  free(key);
+  free(tail);
+  for (i = 0; i < 2; i++) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+  }
+}
+
+// Serve jobs on path until SIGINT or SIGTERM
+int daemon_serve(const char *path) {
+  struct sockaddr_un addr;
+  struct daemon d = {0};
+  int fd, ret = 0;
+
+  if (!socket_dir(path, true)) {
+    fprintf(stderr, "No private directory for the daemon socket!\n");
+    return 1;
+  }
+  if ((fd = daemon_connect(path)) >= 0) {
+    fprintf(stderr, "A loader daemon is already listening on %s!\n", path);
+    close(fd);
+    return 1;
+  }
+  if (!socket_addr(path, &addr)) {
+    fprintf(stderr, "No usable path for the daemon socket!\n");
+    return 1;
+  }
+  if ((d.ftdi = ftdi_new()) == NULL) {
+    fprintf(stderr, "Failed to allocate ftdi structure!\n");
+    return 1;
+  }
+
+  // Nobody is listening on a socket left behind by a daemon that died
+  unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(077);
+  bool ok = fd >= 0 &&
+            bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            listen(fd, 8) == 0;
+  umask(mask);
+  if (!ok) {
+    fprintf(stderr, "Failed to listen on %s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    ftdi_free(d.ftdi);
+    return 1;
+  }
+
+  // A signal gets accept() to return
+  session_catch_stop();
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  fprintf(stdout, "Listening on %s\n", path);
+  while (!session_stopping()) {
+    int c = accept(fd, NULL, NULL);
+    if (c < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "Failed to accept a job: %s\n", strerror(errno));
+      ret = 1;
+      break;
+    }
+    if (peer_is_us(c))
+      serve_job(&d, c);
+    else
+      fprintf(stderr, "Refused a job from another user!\n");
+    close(c);
+  }
+
+  for (int i = 0; i < d.n; i++)
+    session_close(&d.sessions[i]);
+  free(d.sessions);
+  free(d.found);
+  ftdi_free(d.ftdi);
+  close(fd);
+  unlink(path);
+  image_cache_clear();
+  fprintf(stdout, "Stopped.\n");
+  return ret;
+}
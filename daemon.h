@@ -0,0 +1,26 @@
+#ifndef DAEMON_H_
+#define DAEMON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "session.h"
+
+// A long running loader keeps every board's session open and runs the jobs
+// later invocations send it over a Unix domain socket, so a warm job starts
+// right away instead of resetting and setting up the FTDI first.
+const char *daemon_socket_path(void);
+int daemon_serve(const char *path);
+
+// Hand a job to the daemon and wait for it to finish. Returns the exit
+// status for the job, or -1 when no daemon is listening.
+int daemon_submit(const char *path, const char *board_key, bool all,
+                  const struct options *opt);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* DAEMON_H_ */
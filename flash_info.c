@@ -0,0 +1,198 @@
+#include "flash_info.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Parameters for parts without a usable SFDP table, typical and maximum
+ * times are taken from the datasheets */
+static const struct flash_part {
+  uint8_t jedec_id[3];
+  const char *name;
+  long size;
+  uint32_t page_prog_typ_us, page_prog_max_us;
+  uint32_t chip_erase_typ_ms, chip_erase_max_ms;
+} flash_parts[] = {
+    {{0xEF, 0x40, 0x18}, "W25Q128JV-IQ", 16L << 20, 400, 3000, 40000, 200000},
+    {{0xEF, 0x70, 0x18}, "W25Q128JV-IM", 16L << 20, 400, 3000, 40000, 200000},
+    {{0xEF, 0x40, 0x17}, "W25Q64JV-IQ", 8L << 20, 400, 3000, 20000, 100000},
+    {{0xEF, 0x40, 0x16}, "W25Q32JV-IQ", 4L << 20, 400, 3000, 10000, 50000},
+};
+
+/* 4kB/32kB/64kB erase times shared by the Winbond JV parts above */
+static const struct flash_erase_type winbond_erase[] = {
+    {0xD8, 65536, 150000, 2000000},
+    {0x52, 32768, 120000, 1600000},
+    {0x20, 4096, 45000, 400000},
+};
+
+#define N_PARTS (int)(sizeof(flash_parts) / sizeof(flash_parts[0]))
+
+static uint32_t dword(const uint8_t *p, int n) {
+  p += (n - 1) * 4;
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Drop erase types that would break the "each size is a multiple of the
+// next one" ordering the erase planner relies on
+static void sort_erase_types(struct flash_info *info) {
+  for (int i = 1; i < info->n_erase; i++) {
+    for (int j = i; j > 0 && info->erase[j].size > info->erase[j - 1].size;
+         j--) {
+      struct flash_erase_type t = info->erase[j];
+      info->erase[j] = info->erase[j - 1];
+      info->erase[j - 1] = t;
+    }
+  }
+
+  int n = 0;
+  for (int i = 0; i < info->n_erase; i++) {
+    if (n > 0 && (info->erase[n - 1].size == info->erase[i].size ||
+                  info->erase[n - 1].size % info->erase[i].size != 0))
+      continue;
+    info->erase[n++] = info->erase[i];
+  }
+  info->n_erase = n;
+}
+
+bool sfdp_parse_header(const uint8_t *hdr, uint32_t *bfpt_addr,
+                       int *bfpt_dwords) {
+  if (memcmp(hdr, "SFDP", 4) != 0)
+    return false;
+
+  // The first parameter header always describes the basic flash
+  // parameter table
+  const uint8_t *param = hdr + 8;
+  if (param[0] != 0x00 || param[2] != 0x01)
+    return false;
+
+  *bfpt_dwords = param[3];
+  *bfpt_addr = param[4] | param[5] << 8 | param[6] << 16;
+  return *bfpt_dwords >= 9;
+}
+
+bool sfdp_parse_bfpt(struct flash_info *info, const uint8_t *bfpt,
+                     int dwords) {
+  static const uint32_t erase_units_us[] = {1000, 16000, 128000, 1000000};
+  static const uint32_t chip_units_ms[] = {16, 256, 4000, 64000};
+
+  uint32_t dw1 = dword(bfpt, 1), dw2 = dword(bfpt, 2);
+
+  if (dw2 & 0x80000000) {
+    if ((dw2 & 0x7FFFFFFF) < 3 || (dw2 & 0x7FFFFFFF) > 40)
+      return false;
+    info->size = 1L << ((dw2 & 0x7FFFFFFF) - 3);
+  } else {
+    info->size = ((long)dw2 + 1) / 8;
+  }
+
+  switch ((dw1 >> 17) & 0x3) {
+  case 0:
+    info->addr_bytes = 3;
+    info->addr4_cmd = false;
+    break;
+  case 1:
+    info->addr_bytes = info->size > (16L << 20) ? 4 : 3;
+    info->addr4_cmd = info->addr_bytes == 4;
+    break;
+  case 2:
+    info->addr_bytes = 4;
+    info->addr4_cmd = false;
+    break;
+  default:
+    return false;
+  }
+
+  // Erase types 1-4 live in DWORDs 8 and 9, their timings in DWORD 10
+  info->n_erase = 0;
+  for (int i = 0; i < 4; i++) {
+    uint32_t dw = dword(bfpt, 8 + i / 2) >> (16 * (i % 2));
+    uint8_t shift = dw & 0xff, cmd = (dw >> 8) & 0xff;
+    if (shift == 0 || shift > 31)
+      continue;
+
+    struct flash_erase_type *e = &info->erase[info->n_erase++];
+    e->cmd = cmd;
+    e->size = 1UL << shift;
+    e->typ_us = 0;
+    e->max_us = 0;
+    if (dwords >= 10) {
+      uint32_t dw10 = dword(bfpt, 10);
+      uint32_t t = dw10 >> (4 + 7 * i);
+      e->typ_us = ((t & 0x1f) + 1) * erase_units_us[(t >> 5) & 0x3];
+      e->max_us = e->typ_us * 2 * ((dw10 & 0xf) + 1);
+    }
+  }
+
+  // Parts that only list the 4kB erase opcode in DWORD 1
+  if (info->n_erase == 0 && (dw1 & 0x3) == 0x1) {
+    struct flash_erase_type e = {(dw1 >> 8) & 0xff, 4096, 0, 0};
+    info->erase[info->n_erase++] = e;
+  }
+  if (info->n_erase == 0)
+    return false;
+  sort_erase_types(info);
+
+  info->page_size = 256;
+  info->page_prog_typ_us = 0;
+  info->page_prog_max_us = 0;
+  info->chip_erase_typ_ms = 0;
+  info->chip_erase_max_ms = 0;
+  if (dwords >= 11) {
+    uint32_t dw11 = dword(bfpt, 11);
+    uint32_t mult = 2 * ((dw11 & 0xf) + 1);
+    info->page_size = 1 << ((dw11 >> 4) & 0xf);
+    info->page_prog_typ_us =
+        (((dw11 >> 8) & 0x1f) + 1) * ((dw11 & (1 << 13)) ? 64 : 8);
+    info->page_prog_max_us = info->page_prog_typ_us * mult;
+    info->chip_erase_typ_ms =
+        (((dw11 >> 24) & 0x1f) + 1) * chip_units_ms[(dw11 >> 29) & 0x3];
+    info->chip_erase_max_ms = info->chip_erase_typ_ms * mult;
+  }
+
+  info->source = "SFDP";
+  return true;
+}
+
+bool flash_info_lookup(struct flash_info *info, const uint8_t *jedec_id) {
+  for (int i = 0; i < N_PARTS; i++) {
+    const struct flash_part *part = &flash_parts[i];
+    if (memcmp(part->jedec_id, jedec_id, 3) != 0)
+      continue;
+
+    memcpy(info->jedec_id, jedec_id, 3);
+    info->size = part->size;
+    info->page_size = 256;
+    info->addr_bytes = 3;
+    info->addr4_cmd = false;
+    memcpy(info->erase, winbond_erase, sizeof(winbond_erase));
+    info->n_erase = sizeof(winbond_erase) / sizeof(winbond_erase[0]);
+    info->page_prog_typ_us = part->page_prog_typ_us;
+    info->page_prog_max_us = part->page_prog_max_us;
+    info->chip_erase_typ_ms = part->chip_erase_typ_ms;
+    info->chip_erase_max_ms = part->chip_erase_max_ms;
+    info->source = part->name;
+    return true;
+  }
+  return false;
+}
+
+// Conservative W25Q128JV-like parameters for unknown parts
+void flash_info_defaults(struct flash_info *info, const uint8_t *jedec_id) {
+  memset(info, 0, sizeof(*info));
+  flash_info_lookup(info, flash_parts[0].jedec_id);
+  memcpy(info->jedec_id, jedec_id, 3);
+
+  // Dev ID 2 is log2 of the capacity in bytes on most parts
+  if (jedec_id[2] >= 16 && jedec_id[2] <= 24)
+    info->size = 1L << jedec_id[2];
+  info->source = "defaults";
+}
+
+void flash_info_print(const struct flash_info *info) {
+  fprintf(stdout, "Flash %02X %02X %02X: %ld kB, %d byte pages, erase",
+          info->jedec_id[0], info->jedec_id[1], info->jedec_id[2],
+          info->size / 1024, info->page_size);
+  for (int i = info->n_erase - 1; i >= 0; i--)
+    fprintf(stdout, " %ukB", (unsigned)(info->erase[i].size / 1024));
+  fprintf(stdout, ", %d byte addresses (%s)\n", info->addr_bytes,
+          info->source);
+}
@@ -0,0 +1,50 @@
+#ifndef FLASH_INFO_H_
+#define FLASH_INFO_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FLASH_MAX_ERASE_TYPES 4
+
+struct flash_erase_type {
+  uint8_t cmd;
+  uint32_t size;
+  uint32_t typ_us;
+  uint32_t max_us;
+};
+
+struct flash_info {
+  uint8_t jedec_id[3];
+  long size;      // bytes
+  int page_size;  // bytes
+  int addr_bytes; // 3 or 4
+  bool addr4_cmd; // 4 byte addressing has to be entered with a command
+
+  // largest first, each size a multiple of the next one
+  struct flash_erase_type erase[FLASH_MAX_ERASE_TYPES];
+  int n_erase;
+
+  uint32_t page_prog_typ_us;
+  uint32_t page_prog_max_us;
+  uint32_t chip_erase_typ_ms;
+  uint32_t chip_erase_max_ms;
+
+  const char *source; // where the parameters came from
+};
+
+bool sfdp_parse_header(const uint8_t *hdr, uint32_t *bfpt_addr,
+                       int *bfpt_dwords);
+bool sfdp_parse_bfpt(struct flash_info *info, const uint8_t *bfpt,
+                     int dwords);
+bool flash_info_lookup(struct flash_info *info, const uint8_t *jedec_id);
+void flash_info_defaults(struct flash_info *info, const uint8_t *jedec_id);
+void flash_info_print(const struct flash_info *info);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* FLASH_INFO_H_ */
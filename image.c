@@ -0,0 +1,147 @@
+#include "image.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static struct image *cache = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct image *image_map(const char *path);
+static void image_unmap(struct image *img);
+static void cache_remove(struct image *img);
+
+struct image *image_map(const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "Can't open '%s' for reading!\n", path);
+    return NULL;
+  }
+
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "%s: can't determine file size!\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  if (st.st_size == 0) {
+    fprintf(stderr, "%s: file is empty!\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct image *img = calloc(1, sizeof(struct image));
+  if (img == NULL || (img->path = strdup(path)) == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    free(img);
+    close(fd);
+    return NULL;
+  }
+
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "%s: mmap failed: %s\n", path, strerror(errno));
+    free(img->path);
+    free(img);
+    return NULL;
+  }
+
+  // The whole image is streamed front to back. The advice values aren't
+  // flags, so each takes its own call.
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  madvise(data, st.st_size, MADV_WILLNEED);
+
+  img->data = data;
+  img->size = st.st_size;
+  img->dev = st.st_dev;
+  img->ino = st.st_ino;
+  img->mtime = st.st_mtime;
+  return img;
+}
+
+void image_unmap(struct image *img) {
+  munmap((void *)img->data, img->size);
+  free(img->path);
+  free(img);
+}
+
+void cache_remove(struct image *img) {
+  for (struct image **p = &cache; *p; p = &(*p)->next) {
+    if (*p == img) {
+      *p = img->next;
+      break;
+    }
+  }
+}
+
+struct image *image_open(const char *path) {
+  struct stat st;
+  struct image *img;
+
+  pthread_mutex_lock(&cache_lock);
+
+  bool exists = stat(path, &st) == 0;
+  for (img = cache; img; img = img->next) {
+    if (strcmp(img->path, path) != 0)
+      continue;
+
+    if (exists && img->dev == st.st_dev && img->ino == st.st_ino &&
+        img->size == (size_t)st.st_size && img->mtime == st.st_mtime) {
+      img->refs++;
+      pthread_mutex_unlock(&cache_lock);
+      return img;
+    }
+
+    // The file changed since it was mapped
+    cache_remove(img);
+    if (img->refs == 0)
+      image_unmap(img);
+    else
+      img->stale = true;
+    break;
+  }
+
+  img = image_map(path);
+  if (img) {
+    img->refs = 1;
+    img->next = cache;
+    cache = img;
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+  return img;
+}
+
+// Drop a reference, the mapping stays cached for the next image_open()
+void image_close(struct image *img) {
+  if (img == NULL)
+    return;
+
+  pthread_mutex_lock(&cache_lock);
+  if (--img->refs == 0 && img->stale)
+    image_unmap(img);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// Unmap every cached image that isn't in use
+void image_cache_clear(void) {
+  pthread_mutex_lock(&cache_lock);
+  for (struct image **p = &cache; *p;) {
+    struct image *img = *p;
+    if (img->refs == 0) {
+      *p = img->next;
+      image_unmap(img);
+    } else {
+      p = &img->next;
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
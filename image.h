@@ -0,0 +1,38 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+// A read-only memory mapped bitstream or flash image. Images are cached by
+// path so loading the same file again in one process reuses the mapping
+// as long as the file hasn't changed on disk.
+struct image {
+  char *path;
+  const uint8_t *data;
+  size_t size;
+
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+
+  int refs;
+  bool stale; // replaced on disk, unmapped once the last user closes it
+  struct image *next;
+};
+
+struct image *image_open(const char *path);
+void image_close(struct image *img);
+void image_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* IMAGE_H_ */
@@ -1,22 +1,69 @@
 #include "jtag.h"
+#include "bitrev.h"
+#include "image.h"
 #include <string.h>
 #include <unistd.h>
 
 #define LATENCY_MS 16
 #define CHUNK_SIZE 65535
 #define USB_TIMEOUT 5000
+#define BUF_SIZE 4096
+#define BUF_MAX (1024 * 1024)
+#define RLE_MIN_RUN 16 // shorter runs cost more in commands than they save
+#define READ_CHUNK 2048 // TDO bytes per write, two fit the FT2232H RX buffer
+#define PROGRESS_STEP (64 * 1024) // shift bytes per progress report
+
+// A shift queued by jtag_shift_defer(), its raw TDO starts offset bytes into
+// what the FTDI holds for all pending captures
+struct jtag_capture {
+  uint8_t *tdo;
+  unsigned int bits;
+  size_t offset;
+  int moves;
+};
+
+// Where captured TDO goes, into buf or handed to fn as it arrives
+struct tdo_sink {
+  uint8_t *buf;
+  jtag_tdo_fn fn;
+  void *arg;
+};
 
 static bool sync_mpsse(struct ftdi_context *ftdi);
 static bool config_jtag(struct ftdi_context *ftdi);
-
-static unsigned char reverse(unsigned char b) {
-  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-  b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-  return b;
-}
-
-static unsigned char byte_from_hex_string(char *hex, unsigned int offset,
+static unsigned char *queue_reserve(struct jtag_ctx *jtag, size_t n);
+static bool queue_cmd(struct jtag_ctx *jtag, const unsigned char *data,
+                      size_t n);
+static bool queue_data(struct jtag_ctx *jtag, const unsigned char *data,
+                       size_t n, bool rev);
+static bool queue_bytes(struct jtag_ctx *jtag, const uint8_t *tdi, size_t n,
+                        bool rev, bool read);
+static bool queue_run(struct jtag_ctx *jtag, uint8_t value, size_t n);
+static bool queue_bytes_rle(struct jtag_ctx *jtag, const uint8_t *tdi,
+                            size_t n, bool rev);
+static unsigned char *reserve(unsigned char **buf, size_t *size, size_t n);
+static bool queue_tms(struct jtag_ctx *jtag, unsigned int tms, int moves);
+static bool queue_last_bit(struct jtag_ctx *jtag, uint8_t last_bit, bool read,
+                           const struct jtag_fsm_transitions *exit,
+                           int *moves);
+static bool queue_tail(struct jtag_ctx *jtag, unsigned int partial_bits,
+                       uint8_t last_byte, bool read,
+                       const struct jtag_fsm_transitions *exit, int *moves);
+static uint8_t tail_bits(const uint8_t *tail, unsigned int partial_bits,
+                         int moves);
+static bool sink_put(struct tdo_sink *out, size_t offset, const uint8_t *data,
+                     size_t n);
+static bool shift_read(struct jtag_ctx *jtag, const uint8_t *tdi, size_t n,
+                       unsigned int partial_bits, uint8_t last_byte, bool rev,
+                       const struct jtag_fsm_transitions *exit,
+                       struct tdo_sink *out);
+static bool shift_bits(struct jtag_ctx *jtag, size_t bits, const uint8_t *tdi,
+                       bool rev, struct tdo_sink *out);
+static bool read_tdo(struct jtag_ctx *jtag, unsigned char *data, size_t n);
+static bool recv_tdo(struct jtag_ctx *jtag, unsigned char *data, size_t n);
+
+static unsigned char byte_from_hex_string(const char *hex,
+                                          unsigned int offset,
                                           unsigned int num) {
   char tmp[3] = {0, 0, 0};
   tmp[0] = hex[offset];
@@ -26,43 +73,25 @@ static unsigned char byte_from_hex_string(char *hex, unsigned int offset,
   return strtol(tmp, NULL, 16);
 }
 
-static bool compare_hex_string(char *a, char *b, char *mask) {
-  unsigned int a_len = strlen(a);
-  unsigned int b_len = strlen(b);
-
-  if (a_len != b_len) {
-    fprintf(stdout, "length mismatch!\n");
-    return false;
-  }
-
-  if (mask == NULL || strlen(mask) == 0)
-    return (strcmp(a, b) == 0);
-
-  if (a_len != strlen(mask)) {
-    fprintf(stdout, "length and mask mismatch!\n");
-    return false;
-  }
+// Hex strings are written MSB first, their last digit holds the first bits
+static void bits_from_hex(uint8_t *dst, const char *hex, unsigned int bits) {
+  unsigned int req_hex = bits / 4 + (bits % 4 > 0);
 
-  for (unsigned int i = 0; i < a_len / 2; i++) {
-    unsigned char m = byte_from_hex_string(mask, a_len - 2 - i * 2, 2);
-    unsigned char pa = byte_from_hex_string(a, a_len - 2 - i * 2, 2);
-    unsigned char pb = byte_from_hex_string(b, a_len - 2 - i * 2, 2);
-    if ((pa & m) != (pb & m)) {
-      fprintf(stdout, "Mismatch at %d\n", i);
-      return false;
-    }
+  memset(dst, 0, bits / 8 + 1);
+  for (unsigned int i = 0; i < req_hex / 2; i++) {
+    dst[i] = byte_from_hex_string(hex, req_hex - 2 - i * 2, 2);
   }
-  if ((a_len & 1) != 0) {
-    unsigned char m = byte_from_hex_string(mask, 0, 1);
-    unsigned char pa = byte_from_hex_string(a, 0, 1);
-    unsigned char pb = byte_from_hex_string(b, 0, 1);
-    if ((pa & m) != (pb & m)) {
-      fprintf(stdout, "Mismatch at last bit\n");
-      return false;
-    }
+  if ((req_hex & 1) != 0) {
+    dst[req_hex / 2] = byte_from_hex_string(hex, 0, 1);
   }
+}
 
-  return true;
+static void print_bits(const char *label, const uint8_t *data,
+                       unsigned int bits) {
+  fprintf(stderr, "%s", label);
+  for (int i = (bits + 7) / 8 - 1; i >= 0; i--)
+    fprintf(stderr, "%02X", data[i]);
+  fprintf(stderr, "\n");
 }
 
 struct jtag_ctx *jtag_new(struct ftdi_context *ftdi) {
@@ -112,13 +141,211 @@ bool jtag_initialize(struct jtag_ctx *jtag) {
 void jtag_shutdown(struct jtag_ctx *jtag) {
   if (jtag) {
     if (jtag->active) {
+      jtag_flush(jtag);
       ftdi_set_bitmode(jtag->ftdi, 0, BITMODE_RESET);
     }
+    free(jtag->buf);
+    free(jtag->tdi_buf);
+    free(jtag->tdo_buf);
+    free(jtag->captures);
     free(jtag);
     jtag = NULL;
   }
 }
 
+// Append raw MPSSE bytes to the command queue. The queue is written out
+// early only when it would grow past BUF_MAX.
+// Make room for n bytes at the end of the command queue
+unsigned char *queue_reserve(struct jtag_ctx *jtag, size_t n) {
+  if (jtag->buf_len > 0 && jtag->buf_len + n > BUF_MAX) {
+    if (!jtag_flush(jtag))
+      return NULL;
+  }
+
+  if (jtag->buf_len + n > jtag->buf_size) {
+    size_t size = jtag->buf_size ? jtag->buf_size : BUF_SIZE;
+    while (size < jtag->buf_len + n)
+      size *= 2;
+    unsigned char *buf = realloc(jtag->buf, size);
+    if (buf == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      return NULL;
+    }
+    jtag->buf = buf;
+    jtag->buf_size = size;
+  }
+
+  unsigned char *p = jtag->buf + jtag->buf_len;
+  jtag->buf_len += n;
+  return p;
+}
+
+bool queue_cmd(struct jtag_ctx *jtag, const unsigned char *data, size_t n) {
+  unsigned char *p = queue_reserve(jtag, n);
+  if (p == NULL)
+    return false;
+
+  memcpy(p, data, n);
+  return true;
+}
+
+// Queue the payload of a shift command. Data that needs its bits reversed
+// is reversed straight into the command queue, large payloads otherwise go
+// out from where they are without being copied.
+bool queue_data(struct jtag_ctx *jtag, const unsigned char *data, size_t n,
+                bool rev) {
+  if (rev) {
+    unsigned char *p = queue_reserve(jtag, n);
+    if (p == NULL)
+      return false;
+    bitrev_copy(p, data, n);
+    return true;
+  }
+
+  if (n < BUF_SIZE)
+    return queue_cmd(jtag, data, n);
+
+  if (!jtag_flush(jtag))
+    return false;
+  if ((int)n != ftdi_write_data(jtag->ftdi, data, n)) {
+    fprintf(stderr, "Failed to write shift data: %s\n",
+            ftdi_get_error_string(jtag->ftdi));
+    return false;
+  }
+  jtag->usb_bytes += n;
+  return true;
+}
+
+// Queue a shift of n whole bytes from tdi
+bool queue_bytes(struct jtag_ctx *jtag, const uint8_t *tdi, size_t n,
+                 bool rev, bool read) {
+  unsigned char cmd[3];
+
+  while (n > 0) {
+    size_t bct = n > 65536 ? 65536 : n;
+    cmd[0] = read ? 0x39 : 0x19;
+    cmd[1] = (bct - 1) & 0xff;
+    cmd[2] = ((bct - 1) >> 8) & 0xff;
+
+    if (!queue_cmd(jtag, cmd, sizeof(cmd)) ||
+        !queue_data(jtag, tdi, bct, rev)) {
+      return false;
+    }
+    tdi += bct;
+    n -= bct;
+  }
+  return true;
+}
+
+// Clock n bytes without sending data, with TDI held at the level of value
+// (0x00 or 0xFF)
+bool queue_run(struct jtag_ctx *jtag, uint8_t value, size_t n) {
+  // TCK and TMS low, the TAP stays in SHIFT-xR
+  unsigned char cmd[3] = {SET_BITS_LOW, value ? 0x02 : 0x00, 0x0b};
+
+  if (!queue_cmd(jtag, cmd, sizeof(cmd))) {
+    return false;
+  }
+
+  while (n > 0) {
+    size_t bct = n > 65536 ? 65536 : n;
+    cmd[0] = CLK_BYTES;
+    cmd[1] = (bct - 1) & 0xff;
+    cmd[2] = ((bct - 1) >> 8) & 0xff;
+
+    if (!queue_cmd(jtag, cmd, sizeof(cmd))) {
+      return false;
+    }
+    n -= bct;
+  }
+  return true;
+}
+
+// Queue n bytes of TDI that don't need TDO captured. Runs of 0x00 or 0xFF
+// bytes (padding and empty frames in bitstreams, the same either way
+// round) are sent as clocks instead of data.
+bool queue_bytes_rle(struct jtag_ctx *jtag, const uint8_t *tdi, size_t n,
+                     bool rev) {
+  size_t lit = 0, i = 0;
+
+  while (i < n) {
+    uint8_t b = tdi[i];
+    if (b != 0x00 && b != 0xFF) {
+      i++;
+      continue;
+    }
+
+    size_t j = i + 1;
+    while (j < n && tdi[j] == b)
+      j++;
+
+    if (j - i >= RLE_MIN_RUN) {
+      if (!queue_bytes(jtag, tdi + lit, i - lit, rev, false) ||
+          !queue_run(jtag, b, j - i)) {
+        return false;
+      }
+      lit = j;
+    }
+    i = j;
+  }
+  return queue_bytes(jtag, tdi + lit, n - lit, rev, false);
+}
+
+unsigned char *reserve(unsigned char **buf, size_t *size, size_t n) {
+  if (n > *size) {
+    unsigned char *p = realloc(*buf, n);
+    if (p == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      return NULL;
+    }
+    *buf = p;
+    *size = n;
+  }
+  return *buf;
+}
+
+bool jtag_flush(struct jtag_ctx *jtag) {
+  int n = jtag->buf_len;
+
+  if (n == 0)
+    return true;
+
+  jtag->buf_len = 0;
+  jtag->tms_end = 0;
+  if (n != ftdi_write_data(jtag->ftdi, jtag->buf, n)) {
+    fprintf(stderr, "Failed to write MPSSE commands: %s\n",
+            ftdi_get_error_string(jtag->ftdi));
+    return false;
+  }
+  jtag->usb_bytes += n;
+  return true;
+}
+
+// Flush the queue and collect n bytes of TDO data
+bool read_tdo(struct jtag_ctx *jtag, unsigned char *data, size_t n) {
+  unsigned char cmd[1] = {SEND_IMMEDIATE};
+
+  if (!queue_cmd(jtag, cmd, 1) || !jtag_flush(jtag))
+    return false;
+
+  return recv_tdo(jtag, data, n);
+}
+
+// Collect n more bytes of TDO data already requested by read_tdo()
+bool recv_tdo(struct jtag_ctx *jtag, unsigned char *data, size_t n) {
+  while (n > 0) {
+    int len = ftdi_read_data(jtag->ftdi, data, n);
+    if (len < 0) {
+      fprintf(stderr, "Failed to read TDO data: %s\n",
+              ftdi_get_error_string(jtag->ftdi));
+      return false;
+    }
+    data += len;
+    n -= len;
+  }
+  return true;
+}
+
 bool sync_mpsse(struct ftdi_context *ftdi) {
   unsigned char cmd[2] = {0xaa, 0x0};
   int cmdlen = 1;
@@ -211,7 +438,7 @@ bool config_jtag(struct ftdi_context *ftdi) {
 bool jtag_set_freq(struct jtag_ctx *jtag, double freq) {
   unsigned char cmd[3];
   int cmdlen = sizeof(cmd);
-  int divisor = 30.0 / (freq / 1000000.0) - 1.0;
+  int divisor;
 
   if (!jtag->active) {
     fprintf(stderr,
@@ -219,253 +446,503 @@ bool jtag_set_freq(struct jtag_ctx *jtag, double freq) {
     return false;
   }
 
+  if (freq <= 0) {
+    fprintf(stderr, "Invalid JTAG frequency %.0f Hz!\n", freq);
+    return false;
+  }
+
+  // TCK is 30 MHz / (divisor + 1), round down to the next one possible
+  divisor = 30.0 / (freq / 1000000.0) - 1.0;
+  if (30e6 / (divisor + 1) > freq)
+    divisor++;
+  if (divisor < 0)
+    divisor = 0;
+  if (divisor > 0xffff)
+    divisor = 0xffff;
+
   cmd[0] = TCK_DIVISOR;
   cmd[1] = divisor & 0xff;
   cmd[2] = (divisor >> 8) & 0xff;
-  if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
+  if (!queue_cmd(jtag, cmd, cmdlen)) {
     fprintf(stderr, "Failed to send freq clock divisor command\n");
     return false;
   }
 
+  jtag->freq = 30e6 / (divisor + 1);
   return true;
 }
 
 bool jtag_navigate_to_state(struct jtag_ctx *jtag, enum jtag_fsm_state init,
                             enum jtag_fsm_state dest) {
-  unsigned char cmd[3];
-  int cmdlen = sizeof(cmd);
-
   struct jtag_fsm_transitions transitions = get_transitions(init, dest);
-  /*
-   fprintf(stderr, "state1: %s, state2: %s, moves: %d, tms: %d\n",
-   get_state_name(init), get_state_name(dest), transitions.moves,
-   transitions.tms);
-   */
-  if (transitions.moves > 0) {
-    if (transitions.moves < 8) {
-      cmd[0] = 0x4B;
-      cmd[1] = transitions.moves - 1;
-      cmd[2] = 0x7f & transitions.tms;
-      if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
-        return false;
-      }
-    } else {
-      fprintf(stdout, "Transition of 8 moves!\n");
-      cmd[0] = 0x4B;
-      cmd[1] = 6;
-      cmd[2] = 0x7f & transitions.tms;
-      if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
-        return false;
-      }
-      cmd[0] = 0x4B;
-      cmd[1] = transitions.moves - 8;
-      cmd[2] = 0x7f & (transitions.tms >> 7);
-      if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
-        return false;
-      }
-    }
+
+  return queue_tms(jtag, transitions.tms, transitions.moves);
+}
+
+// Make the next shift carry on from exit1 (EXIT1_DR or EXIT1_IR) to dest in
+// the TMS command that clocks its last bit, instead of stopping in exit1
+void jtag_shift_exit(struct jtag_ctx *jtag, enum jtag_fsm_state exit1,
+                     enum jtag_fsm_state dest) {
+  jtag->exit = get_transitions(exit1, dest);
+}
+
+// Masked compare of two bit vectors, a NULL mask compares every bit
+bool jtag_bits_match(const uint8_t *a, const uint8_t *b, const uint8_t *mask,
+                     unsigned int bits) {
+  size_t n = bits / 8, i = 0;
+
+  for (; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t)) {
+    uint64_t wa, wb, wm = UINT64_MAX;
+    memcpy(&wa, a + i, sizeof(wa));
+    memcpy(&wb, b + i, sizeof(wb));
+    if (mask)
+      memcpy(&wm, mask + i, sizeof(wm));
+    if (((wa ^ wb) & wm) != 0)
+      return false;
+  }
+
+  for (; i < n; i++) {
+    if (((a[i] ^ b[i]) & (mask ? mask[i] : 0xFF)) != 0)
+      return false;
+  }
+
+  if (bits % 8 != 0) {
+    uint8_t m = (1 << (bits % 8)) - 1;
+    if (mask)
+      m &= mask[n];
+    if (((a[n] ^ b[n]) & m) != 0)
+      return false;
   }
   return true;
 }
 
-bool jtag_shift_data(struct jtag_ctx *jtag, unsigned int bits, char *tdi,
-                     char *tdo, char *mask, bool from_file) {
-  unsigned char cmd[3];
-  int cmdlen = sizeof(cmd);
+bool jtag_shift(struct jtag_ctx *jtag, unsigned int bits, const uint8_t *tdi,
+                uint8_t *tdo) {
+  struct tdo_sink out = {tdo, NULL, NULL};
+
+  return shift_bits(jtag, bits, tdi, false, tdo ? &out : NULL);
+}
+
+// Shift like jtag_shift(), handing the captured bits to fn a chunk at a time
+// so shifts of any length can be captured without buffering them
+bool jtag_shift_stream(struct jtag_ctx *jtag, size_t bits, const uint8_t *tdi,
+                       jtag_tdo_fn fn, void *arg) {
+  struct tdo_sink out = {NULL, fn, arg};
 
-  unsigned char tdo_buf[bits / 8 + 8];
-  unsigned int tdo_bytes = 0;
+  return shift_bits(jtag, bits, tdi, false, &out);
+}
+
+// Shift and compare the captured bits against expected. A mismatch is
+// reported and fails the shift, unless match is given to take the result.
+bool jtag_shift_check(struct jtag_ctx *jtag, unsigned int bits,
+                      const uint8_t *tdi, const uint8_t *expected,
+                      const uint8_t *mask, bool *match) {
+  uint8_t *tdo = reserve(&jtag->tdo_buf, &jtag->tdo_size, bits / 8 + 1);
+  if (tdo == NULL || !jtag_shift(jtag, bits, tdi, tdo)) {
+    return false;
+  }
+
+  bool ok = jtag_bits_match(tdo, expected, mask, bits);
+  if (!ok) {
+    fprintf(stderr, "TDO didn't match expected value:\n");
+    print_bits("TDO:       ", tdo, bits);
+    print_bits("EXPECTED:  ", expected, bits);
+    if (mask)
+      print_bits("MASK:      ", mask, bits);
+  }
+
+  if (match) {
+    *match = ok;
+    return true;
+  }
+  return ok;
+}
+
+bool jtag_shift_file(struct jtag_ctx *jtag, const char *file, bool rev) {
+  struct image *img = image_open(file);
+  if (img == NULL)
+    return false;
+
+  unsigned long long start = jtag->usb_bytes + jtag->buf_len;
+  bool ret = shift_bits(jtag, img->size * 8, img->data, rev, NULL);
+  unsigned long long sent = jtag->usb_bytes + jtag->buf_len - start;
 
-  /* hack */
-  FILE *fp = NULL;
-  bool rev = (bits == 1);
-  if (from_file) {
-    fp = fopen(tdi, "rb");
-    if (!fp) return false;
-    fseek(fp, 0, SEEK_END);
-    bits = ftell(fp) * 8;
-    fseek(fp, 0, SEEK_SET);
+  if (ret && sent < img->size) {
+    fprintf(stdout, "%s: %zu bytes sent as %llu (%.1f%% saved)\n", file,
+            img->size, sent, 100.0 * (img->size - sent) / img->size);
   }
 
-  unsigned int req_bytes = bits / 8 + (bits % 8 > 0);
+  image_close(img);
+  return ret;
+}
+
+// Hex string form of the shift functions, a mask of NULL skips the TDO
+// check and mismatches are only reported
+bool jtag_shift_data(struct jtag_ctx *jtag, unsigned int bits, char *tdi,
+                     char *tdo, char *mask, bool from_file) {
+  /* hack: with from_file tdi names a file, bits == 1 asks for each byte
+   * to be shifted MSB first as a bitstream requires */
+  if (from_file)
+    return jtag_shift_file(jtag, tdi, bits == 1);
+
   unsigned int req_hex = bits / 4 + (bits % 4 > 0);
+  size_t n = bits / 8 + 1;
 
-  if (!from_file && strlen(tdi) < req_hex)
+  if (strlen(tdi) < req_hex)
     return false;
 
-  bool read = (tdo != NULL) && (strlen(tdo) > 0);
-  if (read) {
-    if (strlen(tdo) < req_hex) {
-      return false;
-    }
-    if (mask != NULL && strlen(mask) < req_hex) {
-      return false;
-    }
+  bool read = (tdo != NULL) && (strlen(tdo) > 0) && (mask != NULL);
+  if (read && (strlen(tdo) < req_hex ||
+               (strlen(mask) > 0 && strlen(mask) < req_hex))) {
+    return false;
   }
 
-  if (!sync_mpsse(jtag->ftdi))
+  uint8_t *buf = reserve(&jtag->tdi_buf, &jtag->tdi_size, 3 * n);
+  if (buf == NULL)
     return false;
 
-  if (bits < 9) {
-    int data = strtol(tdi, NULL, 16);
-    cmd[0] = read ? 0x3B : 0x1B;
-    cmd[1] = bits - 2;
-    cmd[2] = data & 0xff;
-    if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
-      return false;
-    }
+  bits_from_hex(buf, tdi, bits);
+  if (!read)
+    return jtag_shift(jtag, bits, buf, NULL);
 
-    unsigned char last_bit = (data >> ((bits - 1) % 8)) & 0x01;
+  bits_from_hex(buf + n, tdo, bits);
+  if (strlen(mask) > 0)
+    bits_from_hex(buf + 2 * n, mask, bits);
 
-    cmd[0] = read ? 0x6E : 0x4E;
-    cmd[1] = 0x00;
-    cmd[2] = 0x03 | (last_bit << 7);
-    if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
-      return false;
-    }
+  bool match;
+  return jtag_shift_check(jtag, bits, buf, buf + n,
+                          strlen(mask) > 0 ? buf + 2 * n : NULL, &match);
+}
 
-    if (read) {
-      tdo_bytes = ftdi_read_data(jtag->ftdi, cmd, 2);
-      if (tdo_bytes != 2) {
-        fprintf(stderr, "Got %d TDO bytes where as only %d was expected\n",
-                tdo_bytes, 2);
+// Queue TMS moves, the first in bit 0 of tms. They're added to the TMS
+// command queued last as long as nothing came after it and it has room, a
+// command clocks at most 7 moves with TDI held at bit 7 of its data byte.
+bool queue_tms(struct jtag_ctx *jtag, unsigned int tms, int moves) {
+  unsigned char cmd[3] = {0x4B, 0, 0};
+
+  while (moves > 0) {
+    int n;
+
+    if (jtag->tms_end > 0 && jtag->tms_end == jtag->buf_len &&
+        jtag->buf[jtag->buf_len - 2] < 6) {
+      unsigned char *last = jtag->buf + jtag->buf_len - 3;
+      int len = last[1] + 1;
+      n = moves < 7 - len ? moves : 7 - len;
+      last[1] += n;
+      last[2] |= (tms & ((1 << n) - 1)) << len;
+    } else {
+      n = moves < 7 ? moves : 7;
+      cmd[1] = n - 1;
+      cmd[2] = tms & ((1 << n) - 1);
+      if (!queue_cmd(jtag, cmd, sizeof(cmd))) {
         return false;
       }
-
-      tdo_buf[0] = cmd[0] >> (8 - (bits - 1));
-      tdo_buf[0] |= cmd[1] >> (7 - (bits - 1));
-    }
-  } else {
-    unsigned char tdi_buf[req_bytes + 6];
-    if (!from_file) {
-      for (unsigned int i = 0; i < req_hex / 2; i++) {
-        tdi_buf[i] = byte_from_hex_string(tdi, req_hex - 2 - i * 2, 2);
-      }
-      if ((req_hex & 1) != 0) {
-        tdi_buf[req_hex / 2] = byte_from_hex_string(tdi, 0, 1);
-      }
+      jtag->tms_end = jtag->buf_len;
     }
+    tms >>= n;
+    moves -= n;
+  }
+  return true;
+}
+
+// Queue the last bit of a shift with TMS high, followed in the same command
+// by the moves out of EXIT1 when they fit. moves says how many did, the
+// captured bit then arrives at bit 7 - moves.
+bool queue_last_bit(struct jtag_ctx *jtag, uint8_t last_bit, bool read,
+                    const struct jtag_fsm_transitions *exit, int *moves) {
+  unsigned char cmd[3];
 
-    unsigned int full_bytes = (bits - 1) / 8;
-    unsigned int rem_bytes = full_bytes;
-    unsigned int offset = 0;
+  *moves = exit->moves < 7 ? exit->moves : 0;
+  cmd[0] = read ? 0x6E : 0x4E;
+  cmd[1] = *moves;
+  cmd[2] = last_bit << 7 | (exit->tms & ((1 << *moves) - 1)) << 1 | 0x01;
+  if (!queue_cmd(jtag, cmd, sizeof(cmd))) {
+    return false;
+  }
+  if (!read)
+    jtag->tms_end = jtag->buf_len;
 
-    if (full_bytes > 65536 && read) {
-      fprintf(stdout, "Large transfers with reads may not work!\n");
+  return queue_tms(jtag, exit->tms >> *moves, exit->moves - *moves);
+}
+
+// Queue the partial byte and the last bit of a shift, which leaves SHIFT-xR
+bool queue_tail(struct jtag_ctx *jtag, unsigned int partial_bits,
+                uint8_t last_byte, bool read,
+                const struct jtag_fsm_transitions *exit, int *moves) {
+  unsigned char cmd[3];
+  int cmdlen = sizeof(cmd);
+
+  if (partial_bits > 0) {
+    cmd[0] = read ? 0x3B : 0x1B;
+    cmd[1] = partial_bits - 1;
+    cmd[2] = last_byte;
+    if (!queue_cmd(jtag, cmd, cmdlen)) {
+      return false;
     }
+  }
 
-    while (rem_bytes > 0) {
-      unsigned int bct = rem_bytes > 65536 ? 65536 : rem_bytes;
-      cmd[0] = read ? 0x39 : 0x19;
-      cmd[1] = (bct - 1) & 0xff;
-      cmd[2] = ((bct - 1) >> 8) & 0xff;
+  return queue_last_bit(jtag, (last_byte >> partial_bits) & 0x01, read, exit,
+                        moves);
+}
 
-      if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
+// The partial byte and the last bit of a shift as captured, left aligned in
+// the two bytes after the full ones (just the last bit when partial_bits is 0)
+uint8_t tail_bits(const uint8_t *tail, unsigned int partial_bits, int moves) {
+  if (partial_bits == 0)
+    return (tail[0] >> (7 - moves)) & 0x01;
+  return tail[0] >> (8 - partial_bits) |
+         ((tail[1] >> (7 - moves)) & 0x01) << partial_bits;
+}
+
+bool sink_put(struct tdo_sink *out, size_t offset, const uint8_t *data,
+              size_t n) {
+  if (out->fn)
+    return out->fn(out->arg, data, n);
+  memcpy(out->buf + offset, data, n);
+  return true;
+}
+
+// Shift n whole bytes from tdi (zeros if it's NULL) and then the tail,
+// capturing TDO. Data goes out READ_CHUNK bytes per write and each chunk is
+// collected only after the next one is sent, so the MPSSE always has work
+// queued while no more than two chunks of TDO wait in the FTDI.
+bool shift_read(struct jtag_ctx *jtag, const uint8_t *tdi, size_t n,
+                unsigned int partial_bits, uint8_t last_byte, bool rev,
+                const struct jtag_fsm_transitions *exit,
+                struct tdo_sink *out) {
+  static const uint8_t zeros[READ_CHUNK];
+  unsigned char cmd[1] = {SEND_IMMEDIATE};
+  uint8_t chunk[READ_CHUNK], tail[2], value;
+  size_t sent = 0, done = 0;
+  bool tail_sent = false;
+  int moves = 0;
+
+  while (!tail_sent || done < n) {
+    if (!tail_sent) {
+      size_t bct = n - sent > READ_CHUNK ? READ_CHUNK : n - sent;
+      if (!queue_bytes(jtag, tdi ? tdi + sent : zeros, bct, rev, true)) {
         return false;
       }
-      if (from_file) {
-        unsigned char tdi_chunk[bct];
-        fread(tdi_chunk, 1, bct, fp);
-        if (rev) {
-          for (unsigned int i = 0; i < bct; i++) {
-            tdi_chunk[i] = reverse(tdi_chunk[i]);
-          }
-        }
-        if (bct != ftdi_write_data(jtag->ftdi, tdi_chunk, bct)) {
-          return false;
-        }
-      } else {
-        if (bct != ftdi_write_data(jtag->ftdi, tdi_buf + offset, bct)) {
+      sent += bct;
+      if (sent == n) {
+        if (!queue_tail(jtag, partial_bits, last_byte, true, exit, &moves))
           return false;
-        }
+        tail_sent = true;
       }
-
-      rem_bytes -= bct;
-      offset += bct;
+      if (!queue_cmd(jtag, cmd, 1) || !jtag_flush(jtag))
+        return false;
     }
-    if (fp) fclose(fp);
-
-    unsigned int partial_bits = bits - 1 - (full_bytes * 8);
-    if (full_bytes * 8 + 1 != bits) {
-      cmd[0] = read ? 0x3B : 0x1B;
-      cmd[1] = partial_bits - 1;
-      cmd[2] = tdi_buf[req_bytes - 1] & 0xff;
-      if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
+
+    if (done < n && (tail_sent || sent - done > READ_CHUNK)) {
+      size_t bct = n - done > READ_CHUNK ? READ_CHUNK : n - done;
+      uint8_t *dst = out->fn ? chunk : out->buf + done;
+      if (!recv_tdo(jtag, dst, bct) ||
+          (out->fn && !out->fn(out->arg, chunk, bct))) {
         return false;
       }
+      done += bct;
     }
+  }
+
+  // Full bytes arrive as they are, the tail after them
+  if (!recv_tdo(jtag, tail, partial_bits > 0 ? 2 : 1))
+    return false;
+  value = tail_bits(tail, partial_bits, moves);
+  return sink_put(out, n, &value, 1);
+}
+
+// Shift bits from tdi, reversing each byte first with rev, leaving the TAP
+// in EXIT1 or where jtag_shift_exit() asked for. A NULL tdi shifts zeros.
+// With out set the captured bits are stored there.
+bool shift_bits(struct jtag_ctx *jtag, size_t bits, const uint8_t *tdi,
+                bool rev, struct tdo_sink *out) {
+  unsigned char cmd[3];
+  int cmdlen = sizeof(cmd);
+  bool read = out != NULL;
+  struct jtag_fsm_transitions exit = jtag->exit;
+  int moves;
+
+  jtag->exit.moves = 0;
+
+  // TDO of deferred shifts arrives first
+  if (read && !jtag_collect(jtag))
+    return false;
 
-    unsigned char last_bit =
-        (tdi_buf[req_bytes - 1] >> ((bits - 1) % 8)) & 0x01;
-    cmd[0] = read ? 0x6E : 0x4E;
-    cmd[1] = 0x00;
-    cmd[2] = 0x03 | (last_bit << 7);
-    if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
+  if (bits < 9) {
+    // bits - 2 wraps for 0 and 1 bit shifts, giving a bit count the MPSSE
+    // doesn't document. The Au bridge only looks for a USER1 update so
+    // that's left as it always was.
+    unsigned char value = bits > 0 && tdi ? tdi[0] : 0;
+    if (rev) {
+      value = bitrev_byte(value);
+    }
+    cmd[0] = read ? 0x3B : 0x1B;
+    cmd[1] = bits - 2;
+    cmd[2] = value;
+    if (!queue_cmd(jtag, cmd, cmdlen)) {
+      return false;
+    }
+
+    unsigned char last_bit = (value >> ((bits - 1) % 8)) & 0x01;
+    if (!queue_last_bit(jtag, last_bit, read, &exit, &moves)) {
       return false;
     }
 
     if (read) {
-      unsigned char ibuf[req_bytes + 6];
-      size_t bytes_to_read =
-          full_bytes + ((full_bytes * 8 + 1 != bits) ? 2 : 1);
-      if (bytes_to_read != ftdi_read_data(jtag->ftdi, ibuf, bytes_to_read)) {
+      if (!read_tdo(jtag, cmd, 2)) {
         return false;
       }
+      value = cmd[0] >> (8 - (bits - 1));
+      value |= ((cmd[1] >> (7 - moves)) & 0x01) << (bits - 1);
+      return sink_put(out, 0, &value, 1);
+    }
+    return true;
+  }
 
-      for (unsigned int i = 0; i < full_bytes; i++) {
-        tdo_buf[tdo_bytes++] = ibuf[i];
-      }
+  size_t full_bytes = (bits - 1) / 8;
+  unsigned int partial_bits = bits - 1 - (full_bytes * 8);
 
-      if (full_bytes * 8 + 1 != bits) {
-        tdo_buf[tdo_bytes] = ibuf[tdo_bytes] >> (8 - partial_bits);
-        tdo_buf[tdo_bytes++] |= ibuf[bytes_to_read - 1] >> (7 - partial_bits);
-      } else {
-        tdo_buf[tdo_bytes++] = ibuf[bytes_to_read - 1] >> 7;
-      }
+  unsigned char last_byte = tdi ? tdi[full_bytes] : 0;
+  if (rev) {
+    last_byte = bitrev_byte(last_byte);
+  }
+
+  if (read) {
+    return shift_read(jtag, tdi, full_bytes, partial_bits, last_byte, rev,
+                      &exit, out);
+  }
+
+  if (tdi == NULL) {
+    if (!queue_run(jtag, 0x00, full_bytes))
+      return false;
+  } else if (jtag->progress.fn == NULL || full_bytes <= PROGRESS_STEP) {
+    if (!queue_bytes_rle(jtag, tdi, full_bytes, rev))
+      return false;
+  } else {
+    // Runs that cross a step boundary are split, which costs a few bytes
+    for (size_t pos = 0; pos < full_bytes; pos += PROGRESS_STEP) {
+      size_t n = full_bytes - pos > PROGRESS_STEP ? PROGRESS_STEP
+                                                  : full_bytes - pos;
+      if (!queue_bytes_rle(jtag, tdi + pos, n, rev))
+        return false;
+      progress_report(&jtag->progress, pos + n, full_bytes);
     }
   }
+  return queue_tail(jtag, partial_bits, last_byte, false, &exit, &moves);
+}
 
-  bool ret = true;
-  if (read && mask) {
-    // Read out the data from input buffer
-    char hextdo[tdo_bytes * 2 + 1];
-    int hextdoat = 0;
-    int tdo_off = tdo_bytes - strlen(mask) / 2;
+// Clock TCK with TMS and TDI left where they are, which keeps the TAP in
+// the state it's in when that's a stable one
+bool jtag_send_clocks(struct jtag_ctx *jtag, unsigned long cycles) {
+  unsigned char cmd[3];
 
-    for (int i = tdo_bytes - 1 - tdo_off; i >= 0; i--) {
-      sprintf(hextdo + hextdoat, "%02X", tdo_buf[i]);
-      hextdoat += 2;
+  while (cycles >= 8) {
+    unsigned long bytes = cycles / 8 > 65536 ? 65536 : cycles / 8;
+    cmd[0] = CLK_BYTES;
+    cmd[1] = (bytes - 1) & 0xff;
+    cmd[2] = ((bytes - 1) >> 8) & 0xff;
+    if (!queue_cmd(jtag, cmd, 3)) {
+      return false;
     }
+    cycles -= bytes * 8;
+  }
 
-    if (!compare_hex_string(hextdo, tdo, mask)) {
-      fprintf(stderr, "TDO didn't match expected string: \n");
-      fprintf(stderr, "TDO:       %s\n", hextdo);
-      fprintf(stderr, "EXPECTED:  %s\n", tdo);
-      fprintf(stderr, "MASK:      %s\n", mask);
-      ret = true;
+  if (cycles > 0) {
+    cmd[0] = CLK_BITS;
+    cmd[1] = cycles - 1;
+    if (!queue_cmd(jtag, cmd, 2)) {
+      return false;
     }
   }
-  return ret;
+
+  return true;
 }
 
-bool jtag_send_clocks(struct jtag_ctx *jtag, unsigned long cycles) {
-  unsigned char cmd[3];
-  int cmdlen = sizeof(cmd);
+// Queue a capturing shift without waiting for its TDO. As long as what's
+// pending fits the FTDI RX buffer the MPSSE never stalls on it, so records
+// can pile up in the queue and be collected with a single read. Shifts too
+// long for that go through jtag_shift() right away.
+bool jtag_shift_defer(struct jtag_ctx *jtag, unsigned int bits,
+                      const uint8_t *tdi, uint8_t *tdo) {
+  static const uint8_t zeros[READ_CHUNK];
+  struct jtag_fsm_transitions exit = jtag->exit;
+  struct jtag_capture *c;
+
+  if (bits == 0) {
+    fprintf(stderr, "Can't capture a 0 bit shift!\n");
+    return false;
+  }
+
+  size_t full_bytes = (bits - 1) / 8;
+  unsigned int partial_bits = bits - 1 - full_bytes * 8;
+  size_t raw = full_bytes + (partial_bits > 0 ? 2 : 1);
 
-  if (cycles / 8 > 65536) {
-    if (!jtag_send_clocks(jtag, cycles - 65536 * 8)) {
+  if (raw > READ_CHUNK)
+    return jtag_shift(jtag, bits, tdi, tdo);
+  if (jtag->pending_tdo + raw > READ_CHUNK && !jtag_collect(jtag))
+    return false;
+
+  if (jtag->n_captures == jtag->captures_size) {
+    size_t size = jtag->captures_size ? jtag->captures_size * 2 : 64;
+    c = realloc(jtag->captures, size * sizeof(*c));
+    if (c == NULL) {
+      fprintf(stderr, "Out of memory!\n");
       return false;
     }
-    cycles = 65536 * 8;
+    jtag->captures = c;
+    jtag->captures_size = size;
   }
-  cycles /= 8;
 
-  cmd[0] = CLK_BYTES;
-  cmd[1] = (cycles - 1) & 0xff;
-  cmd[2] = ((cycles - 1) >> 8) & 0xff;
-  if (cmdlen != ftdi_write_data(jtag->ftdi, cmd, cmdlen)) {
+  c = &jtag->captures[jtag->n_captures];
+  c->tdo = tdo;
+  c->bits = bits;
+  c->offset = jtag->pending_tdo;
+
+  jtag->exit.moves = 0;
+  if (!queue_bytes(jtag, tdi ? tdi : zeros, full_bytes, false, true) ||
+      !queue_tail(jtag, partial_bits, tdi ? tdi[full_bytes] : 0, true, &exit,
+                  &c->moves)) {
     return false;
   }
 
+  jtag->n_captures++;
+  jtag->pending_tdo += raw;
   return true;
 }
+
+// Read the TDO of all deferred shifts and store it where they asked for
+bool jtag_collect(struct jtag_ctx *jtag) {
+  uint8_t raw[READ_CHUNK];
+  size_t n = jtag->n_captures;
+
+  if (n == 0)
+    return true;
+
+  jtag->n_captures = 0;
+  if (!read_tdo(jtag, raw, jtag->pending_tdo))
+    return false;
+  jtag->pending_tdo = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    struct jtag_capture *c = &jtag->captures[i];
+    size_t full_bytes = (c->bits - 1) / 8;
+    unsigned int partial_bits = c->bits - 1 - full_bytes * 8;
+
+    memcpy(c->tdo, raw + c->offset, full_bytes);
+    c->tdo[full_bytes] =
+        tail_bits(raw + c->offset + full_bytes, partial_bits, c->moves);
+  }
+  return true;
+}
+
+// Drop the deferred shifts, for callers whose TDO buffers are about to go
+// away. Their TDO is still read, into scratch, so later reads stay in step.
+void jtag_discard(struct jtag_ctx *jtag) {
+  uint8_t raw[READ_CHUNK];
+  size_t pending = jtag->pending_tdo;
+
+  jtag->n_captures = 0;
+  jtag->pending_tdo = 0;
+  if (pending > 0)
+    read_tdo(jtag, raw, pending);
+}
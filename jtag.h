@@ -7,23 +7,87 @@ extern "C" {
 
 #include <ftdi.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include "jtag_fsm.h"
+#include "progress.h"
+
+struct jtag_capture;
 
 struct jtag_ctx {
   struct ftdi_context *ftdi;
   bool active;
+  double freq; // TCK in Hz as set by jtag_set_freq()
+
+  // pending MPSSE commands, written out when TDO data is needed, when the
+  // queue fills up or on jtag_flush()
+  unsigned char *buf;
+  size_t buf_len;
+  size_t buf_size;
+
+  // scratch space for decoded TDI and captured TDO data, reused between
+  // shifts
+  unsigned char *tdi_buf;
+  size_t tdi_size;
+  unsigned char *tdo_buf;
+  size_t tdo_size;
+
+  // bytes written to the FTDI
+  unsigned long long usb_bytes;
+
+  // end of the TMS command queued last while more moves can go into it
+  size_t tms_end;
+  // moves out of EXIT1 for the next shift, see jtag_shift_exit()
+  struct jtag_fsm_transitions exit;
+
+  // shifts queued by jtag_shift_defer() whose TDO hasn't been collected, and
+  // how many bytes of it the FTDI holds for them
+  struct jtag_capture *captures;
+  size_t n_captures;
+  size_t captures_size;
+  size_t pending_tdo;
+
+  // reports how much of a long shift has been queued
+  struct progress progress;
 };
 
 struct jtag_ctx *jtag_new();
 void jtag_shutdown(struct jtag_ctx *jtag);
 bool jtag_initialize(struct jtag_ctx *jtag);
+bool jtag_flush(struct jtag_ctx *jtag);
 bool jtag_set_freq(struct jtag_ctx *jtag, double freq);
 bool jtag_navigate_to_state(struct jtag_ctx *jtag, enum jtag_fsm_state init,
                             enum jtag_fsm_state dest);
+void jtag_shift_exit(struct jtag_ctx *jtag, enum jtag_fsm_state exit1,
+                     enum jtag_fsm_state dest);
+
+/* Receives captured TDO in shift order, n bytes at a time. Returning false
+ * aborts the shift. */
+typedef bool (*jtag_tdo_fn)(void *arg, const uint8_t *tdo, size_t n);
+
+/* Bit vectors hold bit i of a shift in bit i % 8 of byte i / 8, the first
+ * bit shifted is the LSB of the first byte. A NULL tdi shifts zeros. */
+bool jtag_shift(struct jtag_ctx *jtag, unsigned int bits, const uint8_t *tdi,
+                uint8_t *tdo);
+bool jtag_shift_stream(struct jtag_ctx *jtag, size_t bits, const uint8_t *tdi,
+                       jtag_tdo_fn fn, void *arg);
+/* jtag_shift_defer() only queues the shift. tdo is filled in by the next
+ * jtag_collect() or capturing shift and has to stay valid until then, or
+ * until jtag_discard() drops the pending shifts. */
+bool jtag_shift_defer(struct jtag_ctx *jtag, unsigned int bits,
+                      const uint8_t *tdi, uint8_t *tdo);
+bool jtag_collect(struct jtag_ctx *jtag);
+void jtag_discard(struct jtag_ctx *jtag);
+bool jtag_shift_check(struct jtag_ctx *jtag, unsigned int bits,
+                      const uint8_t *tdi, const uint8_t *expected,
+                      const uint8_t *mask, bool *match);
+bool jtag_shift_file(struct jtag_ctx *jtag, const char *file, bool rev);
+bool jtag_bits_match(const uint8_t *a, const uint8_t *b, const uint8_t *mask,
+                     unsigned int bits);
 bool jtag_shift_data(struct jtag_ctx *jtag, unsigned int, char *, char *,
                      char *, bool);
+
 bool jtag_send_clocks(struct jtag_ctx *jtag, unsigned long cycles);
 
 #ifdef __cplusplus
@@ -1,6 +1,58 @@
 #include "jtag_fsm.h"
 
-#define QSZ 64
+// Shortest TMS paths between TAP states, indexed [from][to]. The high byte
+// holds the number of moves, the low byte the TMS bits with the first move
+// in bit 0. Where paths tie, the one taking TMS low first is used.
+static const uint16_t tms_paths[16][16] = {
+    // from TEST_LOGIC_RESET
+    {0x000, 0x100, 0x202, 0x302, 0x402, 0x40a, 0x50a, 0x62a,
+     0x51a, 0x306, 0x406, 0x506, 0x516, 0x616, 0x756, 0x636},
+    // from RUN_TEST_IDLE
+    {0x307, 0x000, 0x101, 0x201, 0x301, 0x305, 0x405, 0x515,
+     0x40d, 0x203, 0x303, 0x403, 0x40b, 0x50b, 0x62b, 0x51b},
+    // from SELECT_DR_SCAN
+    {0x203, 0x303, 0x000, 0x100, 0x200, 0x202, 0x302, 0x40a,
+     0x306, 0x101, 0x201, 0x301, 0x305, 0x405, 0x515, 0x40d},
+    // from CAPTURE_DR
+    {0x51f, 0x303, 0x307, 0x000, 0x100, 0x101, 0x201, 0x305,
+     0x203, 0x40f, 0x50f, 0x60f, 0x62f, 0x72f, 0x8af, 0x76f},
+    // from SHIFT_DR
+    {0x51f, 0x303, 0x307, 0x407, 0x000, 0x101, 0x201, 0x305,
+     0x203, 0x40f, 0x50f, 0x60f, 0x62f, 0x72f, 0x8af, 0x76f},
+    // from EXIT1_DR
+    {0x40f, 0x201, 0x203, 0x303, 0x302, 0x000, 0x100, 0x202,
+     0x101, 0x307, 0x407, 0x507, 0x517, 0x617, 0x757, 0x637},
+    // from PAUSE_DR
+    {0x51f, 0x303, 0x307, 0x407, 0x201, 0x305, 0x000, 0x101,
+     0x203, 0x40f, 0x50f, 0x60f, 0x62f, 0x72f, 0x8af, 0x76f},
+    // from EXIT2_DR
+    {0x40f, 0x201, 0x203, 0x303, 0x100, 0x202, 0x302, 0x000,
+     0x101, 0x307, 0x407, 0x507, 0x517, 0x617, 0x757, 0x637},
+    // from UPDATE_DR
+    {0x307, 0x100, 0x101, 0x201, 0x301, 0x305, 0x405, 0x515,
+     0x000, 0x203, 0x303, 0x403, 0x40b, 0x50b, 0x62b, 0x51b},
+    // from SELECT_IR_SCAN
+    {0x101, 0x201, 0x305, 0x405, 0x505, 0x515, 0x615, 0x755,
+     0x635, 0x000, 0x100, 0x200, 0x202, 0x302, 0x40a, 0x306},
+    // from CAPTURE_IR
+    {0x51f, 0x303, 0x307, 0x407, 0x507, 0x517, 0x617, 0x757,
+     0x637, 0x40f, 0x000, 0x100, 0x101, 0x201, 0x305, 0x203},
+    // from SHIFT_IR
+    {0x51f, 0x303, 0x307, 0x407, 0x507, 0x517, 0x617, 0x757,
+     0x637, 0x40f, 0x50f, 0x000, 0x101, 0x201, 0x305, 0x203},
+    // from EXIT1_IR
+    {0x40f, 0x201, 0x203, 0x303, 0x403, 0x40b, 0x50b, 0x62b,
+     0x51b, 0x307, 0x407, 0x302, 0x000, 0x100, 0x202, 0x101},
+    // from PAUSE_IR
+    {0x51f, 0x303, 0x307, 0x407, 0x507, 0x517, 0x617, 0x757,
+     0x637, 0x40f, 0x50f, 0x201, 0x305, 0x000, 0x101, 0x203},
+    // from EXIT2_IR
+    {0x40f, 0x201, 0x203, 0x303, 0x403, 0x40b, 0x50b, 0x62b,
+     0x51b, 0x307, 0x407, 0x100, 0x202, 0x302, 0x000, 0x101},
+    // from UPDATE_IR
+    {0x307, 0x100, 0x101, 0x201, 0x301, 0x305, 0x405, 0x515,
+     0x40d, 0x203, 0x303, 0x403, 0x40b, 0x50b, 0x62b, 0x000},
+};
 
 enum jtag_fsm_state get_transition(enum jtag_fsm_state state, bool tms) {
   switch (state) {
@@ -42,41 +94,9 @@ enum jtag_fsm_state get_transition(enum jtag_fsm_state state, bool tms) {
 
 struct jtag_fsm_transitions get_transitions(enum jtag_fsm_state init,
                                             enum jtag_fsm_state final) {
-  struct jtag_fsm_transitions queue[QSZ] = {0};
-  int qs = 0, qh = 0, qt = 0;
-  struct jtag_fsm_transitions t = {init, 0, 0};
+  uint16_t path = tms_paths[init][final];
+  struct jtag_fsm_transitions t = {final, path & 0xff, path >> 8};
 
-  queue[0] = t;
-  qs++;
-
-  while (qs > 0) {
-    t = queue[qh];
-    qh = (qh + 1) % QSZ;
-    qs--;
-
-    if (t.current_state == final) {
-      break;
-    }
-
-    enum jtag_fsm_state s0 = get_transition(t.current_state, false);
-    enum jtag_fsm_state s1 = get_transition(t.current_state, true);
-
-    if ((qs + 1) >= QSZ)
-      abort();
-
-    t.moves++;
-    t.tms &= ~(1 << (t.moves - 1)); // clear bit
-    t.current_state = s0;
-    qt = (qt + 1) % QSZ;
-    queue[qt] = t;
-    qs++;
-
-    t.tms |= (1 << (t.moves - 1));
-    t.current_state = s1;
-    qt = (qt + 1) % QSZ;
-    queue[qt] = t;
-    qs++;
-  }
   return t;
 }
 
@@ -1,21 +1,133 @@
 #include "loader.h"
+#include "bitrev.h"
+#include "image.h"
 #include "jtag.h"
+#include "svf.h"
 #include <stdio.h>
 #include <unistd.h>
 
+#define TUNE_ROUNDS 16 // IDCODE reads per frequency step, every 4th with STAT
+
+// Status captured in IR
+#define IR_INIT 0x10 // INIT_COMPLETE
+#define IR_DONE 0x20
+
+// Polls for INIT after JPROGRAM and DONE after JSTART. The totals match the
+// fixed delays they replace, 100ms and 100000 TCKs.
+#define INIT_POLL_US 1000
+#define INIT_POLLS 100
+#define START_POLL_CLOCKS 2000
+#define START_POLLS 50
+#define BOOT_POLLS 2000 // DONE after rebooting from flash, 2s
+
+// STAT bits
+#define STAT_CRC_ERROR (1u << 0)
+#define STAT_EOS (1u << 4)
+#define STAT_INIT_COMPLETE (1u << 11)
+#define STAT_DONE (1u << 14)
+#define STAT_CONFIGURED (STAT_EOS | STAT_INIT_COMPLETE | STAT_DONE)
+
+// Configuration packets
+#define CFG_DUMMY 0xFFFFFFFF
+#define CFG_SYNC 0xAA995566
+#define CFG_NOOP 0x20000000
+#define CFG_TYPE1 1
+#define CFG_TYPE2 2
+#define CFG_WRITE 2
+#define CFG_READ 1
+#define CFG_FAR 1
+#define CFG_FDRI 2
+#define CFG_FDRO 3
+#define CFG_CMD 4
+#define CMD_RCFG 4
+#define CMD_RCRC 7
+#define CMD_DESYNC 13
+#define TYPE1(op, reg, n) (0x20000000u | (op) << 27 | (reg) << 13 | (n))
+#define TYPE2(op, n) (0x40000000u | (op) << 27 | (n))
+
+#define FRAME_WORDS 101 // 7-series configuration frame
+
 static bool loader_set_IR(struct loader_ctx *loader, enum instruction);
-static bool loader_shift_DR(struct loader_ctx *loader, int bits, char *write,
-                            char *read, char *mask, bool from_file);
-static bool loader_shift_IR(struct loader_ctx *loader, int, char *, char *,
-                            char *);
+static bool loader_shift_DR(struct loader_ctx *loader, int bits,
+                            const uint8_t *write, const uint8_t *read,
+                            const uint8_t *mask);
+static bool loader_shift_file(struct loader_ctx *loader, char *file,
+                              bool rev);
+static bool loader_shift_IR(struct loader_ctx *loader, int bits,
+                            const uint8_t *write, const uint8_t *read,
+                            const uint8_t *mask);
+static bool loader_shift(struct loader_ctx *loader, int bits,
+                         const uint8_t *write, const uint8_t *read,
+                         const uint8_t *mask);
 static bool loader_load_bin(struct loader_ctx *loader, char *file);
 static bool loader_set_state(struct loader_ctx *loader,
                              enum jtag_fsm_state state);
+static bool loader_capture_DR(struct loader_ctx *loader, int bits,
+                              const uint8_t *write, uint8_t *read);
+static bool loader_capture_IR(struct loader_ctx *loader, enum instruction inst,
+                              uint8_t *status);
+static bool loader_poll_IR(struct loader_ctx *loader, enum instruction inst,
+                           uint8_t want, uint8_t mask, int polls,
+                           unsigned long clocks, bool *ready);
+static bool loader_read_idcode(struct loader_ctx *loader, uint8_t *id);
+static bool loader_read_usercode(struct loader_ctx *loader, uint8_t *usercode,
+                                 bool *done);
+static bool loader_bridge_resident(struct loader_ctx *loader);
+static bool loader_open_bridge(struct loader_ctx *loader,
+                               const char *loader_file);
+static bool loader_read_stat(struct loader_ctx *loader, uint8_t *stat);
+static bool loader_test_freq(struct loader_ctx *loader, double freq,
+                             const uint8_t *ref_id, const uint8_t *ref_stat);
+static uint32_t stat_word(const uint8_t *stat);
+static bool loader_check_stat(struct loader_ctx *loader);
+static void cfg_bits(uint8_t *dst, const uint32_t *words, int n);
+static bool find_frames(const struct image *img, uint32_t *far,
+                        const uint8_t **data, size_t *words);
+static bool verify_frames(void *arg, const uint8_t *tdo, size_t n);
+static bool loader_readback(struct loader_ctx *loader, uint32_t far,
+                            size_t words, jtag_tdo_fn fn, void *arg);
+static bool loader_verify_frames(struct loader_ctx *loader,
+                                 const struct image *img,
+                                 const struct image *msk);
+
+// Compares configuration readback against frame data from a bitstream
+struct frame_check {
+  const uint8_t *data; // expected frames as they appear in the bitstream
+  const uint8_t *mask; // set bits aren't compared, or NULL
+  size_t size;         // bytes to compare
+  size_t pos;          // readback bytes seen, including the pad frame
+  size_t errors;       // mismatching words
+  size_t first;        // first mismatching word
+  uint32_t read, expected;
+  uint32_t word; // readback word being assembled
+  uint8_t diff;  // its unmasked differences so far
+  const struct progress *progress;
+};
+
+/* DR values, first shifted byte first */
+static const uint8_t zero_word[4] = {0x00, 0x00, 0x00, 0x00};
+
+// FPGA IDCODE 0x0362D093, any revision
+static const uint8_t idcode[4] = {0x93, 0xD0, 0x62, 0x03};
+static const uint8_t idcode_mask[4] = {0xFF, 0xFF, 0xFF, 0x0F};
+
+// Sync word, NOOP, read 1 word from STAT, NOOP, NOOP, as bit-reversed
+// configuration words
+static const uint8_t stat_read[20] = {
+    0x55, 0x99, 0xaa, 0x66, 0x04, 0x00, 0x00, 0x00, 0x14, 0x00,
+    0x07, 0x80, 0x04, 0x00, 0x00, 0x00, 0x04, 0x00, 0x00, 0x00};
+
+// TCK steps tried by loader_tune_freq(), slowest first
+static const double tune_steps[] = {1e6,  2e6,  3e6,  5e6,
+                                    7.5e6, 10e6, 15e6, 30e6};
+#define N_TUNE_STEPS (int)(sizeof(tune_steps) / sizeof(tune_steps[0]))
 
 struct loader_ctx *loader_new(struct jtag_ctx *dev) {
   struct loader_ctx *loader = calloc(1, sizeof(struct loader_ctx));
   loader->device = dev;
   loader->current_state = TEST_LOGIC_RESET;
+  loader->config_freq = LOADER_CONFIG_FREQ;
+  loader->bridge_freq = LOADER_BRIDGE_FREQ;
   return loader;
 }
 
@@ -33,66 +145,87 @@ bool loader_reset_state(struct loader_ctx *loader) {
 }
 
 bool loader_set_IR(struct loader_ctx *loader, enum instruction inst) {
-  char inst_str[8];
-  sprintf(inst_str, "%02x", inst);
+  uint8_t ir = inst;
 
   if (!jtag_navigate_to_state(loader->device, loader->current_state,
                               SHIFT_IR)) {
     fprintf(stderr, "Failed to change to SHIFT_IR state!\n");
     return false;
   }
-  if (!jtag_shift_data(loader->device, 6, inst_str, "", "", false)) {
+  jtag_shift_exit(loader->device, EXIT1_IR, RUN_TEST_IDLE);
+  if (!jtag_shift(loader->device, 6, &ir, NULL)) {
     fprintf(stderr, "Failed to shift instruction data!\n");
     return false;
   }
-  if (!jtag_navigate_to_state(loader->device, EXIT1_IR, RUN_TEST_IDLE)) {
-    fprintf(stderr, "Failed to change to RUN_TEST_IDLE state!\n");
-    return false;
-  }
   loader->current_state = RUN_TEST_IDLE;
   return true;
 }
 
-bool loader_shift_DR(struct loader_ctx *loader, int bits, char *write,
-                     char *read, char *mask, bool from_file) {
+// Shift write in, checking the captured bits against read under mask when
+// read is given. Mismatches are reported but don't fail the shift.
+bool loader_shift(struct loader_ctx *loader, int bits, const uint8_t *write,
+                  const uint8_t *read, const uint8_t *mask) {
+  bool match;
+
+  if (read == NULL)
+    return jtag_shift(loader->device, bits, write, NULL);
+  return jtag_shift_check(loader->device, bits, write, read, mask, &match);
+}
+
+bool loader_shift_DR(struct loader_ctx *loader, int bits, const uint8_t *write,
+                     const uint8_t *read, const uint8_t *mask) {
   if (!jtag_navigate_to_state(loader->device, loader->current_state,
                               SHIFT_DR)) {
     fprintf(stderr, "Failed to change to SHIFT_DR state!\n");
     return false;
   }
-  if (!jtag_shift_data(loader->device, bits, write, read, mask, from_file)) {
+  jtag_shift_exit(loader->device, EXIT1_DR, RUN_TEST_IDLE);
+  if (!loader_shift(loader, bits, write, read, mask)) {
     fprintf(stderr, "Failed to shift data!\n");
     return false;
   }
-  if (!jtag_navigate_to_state(loader->device, EXIT1_DR, RUN_TEST_IDLE)) {
-    fprintf(stderr, "Failed to change to RUN_TEST_IDLE state!\n");
+  loader->current_state = RUN_TEST_IDLE;
+  return true;
+}
+
+// Shift a whole file into DR, rev shifts each byte MSB first
+bool loader_shift_file(struct loader_ctx *loader, char *file, bool rev) {
+  if (!jtag_navigate_to_state(loader->device, loader->current_state,
+                              SHIFT_DR)) {
+    fprintf(stderr, "Failed to change to SHIFT_DR state!\n");
+    return false;
+  }
+  jtag_shift_exit(loader->device, EXIT1_DR, RUN_TEST_IDLE);
+  if (!jtag_shift_file(loader->device, file, rev)) {
+    fprintf(stderr, "Failed to shift data!\n");
     return false;
   }
   loader->current_state = RUN_TEST_IDLE;
   return true;
 }
 
-bool loader_shift_IR(struct loader_ctx *loader, int bits, char *write,
-                     char *read, char *mask) {
+bool loader_shift_IR(struct loader_ctx *loader, int bits, const uint8_t *write,
+                     const uint8_t *read, const uint8_t *mask) {
   if (!jtag_navigate_to_state(loader->device, loader->current_state,
                               SHIFT_IR)) {
     fprintf(stderr, "Failed to change to SHIFT_IR state!\n");
     return false;
   }
-  if (!jtag_shift_data(loader->device, bits, write, read, mask, false)) {
+  jtag_shift_exit(loader->device, EXIT1_IR, RUN_TEST_IDLE);
+  if (!loader_shift(loader, bits, write, read, mask)) {
     fprintf(stderr, "Failed to shift data!\n");
     return false;
   }
-  if (!jtag_navigate_to_state(loader->device, EXIT1_IR, RUN_TEST_IDLE)) {
-    fprintf(stderr, "Failed to change to RUN_TEST_IDLE state!\n");
-    return false;
-  }
   loader->current_state = RUN_TEST_IDLE;
   return true;
 }
 
 bool loader_load_bin(struct loader_ctx *loader, char *file) {
-  if (!jtag_set_freq(loader->device, 10000000)) {
+  // IR values and the status captured while shifting them
+  const uint8_t ir_idcode = IDCODE, start_tdo = 0x31, start_mask = 0x11;
+  bool ready;
+
+  if (!jtag_set_freq(loader->device, loader->config_freq)) {
     fprintf(stderr, "Failed to set JTAG frequency!\n");
     return false;
   }
@@ -101,73 +234,107 @@ bool loader_load_bin(struct loader_ctx *loader, char *file) {
   if (!loader_set_state(loader, RUN_TEST_IDLE))
     return false;
 
+  loader->bridge = NULL;
   if (!loader_set_IR(loader, JPROGRAM))
     return false;
-  if (!loader_set_IR(loader, ISC_NOOP))
-    return false;
-
-  usleep(100000);
 
-  // config/jprog/poll
-  if (!jtag_send_clocks(loader->device, 10000))
-    return false;
-  if (!loader_shift_IR(loader, 6, "14", "11", "31"))
+  // config/jprog/poll, INIT comes back once the configuration memory is clear
+  if (!loader_poll_IR(loader, ISC_NOOP, IR_INIT, IR_INIT | IR_DONE,
+                      INIT_POLLS, 0, &ready))
     return false;
+  if (!ready)
+    fprintf(stderr, "Timed out waiting for INIT!\n");
 
   // config/slr
   if (!loader_set_IR(loader, CFG_IN))
     return false;
-  if (!loader_shift_DR(loader, 1, file, "", "", true)) {
+  if (!loader_shift_file(loader, file, true)) {
     return false;
   }
 
-  // config/start
-  if (!loader_set_state(loader, RUN_TEST_IDLE))
-    return false;
-  if (!jtag_send_clocks(loader->device, 100000))
-    return false;
+  // config/start, clock the startup sequence until DONE goes high
   if (!loader_set_IR(loader, JSTART))
     return false;
-  if (!loader_set_state(loader, RUN_TEST_IDLE))
+  if (!loader_poll_IR(loader, JSTART, IR_DONE, IR_DONE, START_POLLS,
+                      START_POLL_CLOCKS, &ready))
     return false;
+  if (!ready)
+    fprintf(stderr, "Timed out waiting for DONE!\n");
   if (!jtag_send_clocks(loader->device, 100))
     return false;
-  if (!loader_shift_IR(loader, 6, "09", "31", "11"))
+  if (!loader_shift_IR(loader, 6, &ir_idcode, &start_tdo, &start_mask))
     return false;
 
   // config/status
-  if (!loader_set_state(loader, TEST_LOGIC_RESET))
-    return false;
-  if (!jtag_send_clocks(loader->device, 5))
-    return false;
-  if (!loader_set_IR(loader, CFG_IN))
-    return false;
-  if (!loader_shift_DR(loader, 160, "0000000400000004800700140000000466aa9955",
-                       "", "", false))
-    return false;
-  if (!loader_set_IR(loader, CFG_OUT))
+  return loader_check_stat(loader);
+}
+
+// Make sure the flash bridge in loader_file is running, loading it only when
+// it isn't resident from an earlier operation in this session
+bool loader_open_bridge(struct loader_ctx *loader, const char *loader_file) {
+  if (loader->bridge != NULL && strcmp(loader->bridge, loader_file) == 0 &&
+      loader_bridge_resident(loader)) {
+    fprintf(stdout, "Reusing loaded flash bridge...\n");
+  } else {
+    fprintf(stdout, "Initializing FPGA...\n");
+    if (!loader_load_bin(loader, (char *)loader_file) ||
+        !loader_read_usercode(loader, loader->bridge_usercode, NULL)) {
+      fprintf(stderr, "Failed to initialize FPGA!\n");
+      return false;
+    }
+    loader->bridge = loader_file;
+  }
+
+  if (!jtag_set_freq(loader->device, loader->bridge_freq)) {
+    fprintf(stderr, "Failed to set JTAG frequency!\n");
     return false;
-  if (!loader_shift_DR(loader, 32, "00000000", "3f5e0d40", "08000000", false))
+  }
+  return true;
+}
+
+// Whether the FPGA is still configured with the bridge loaded last, going by
+// DONE and its USERCODE
+bool loader_bridge_resident(struct loader_ctx *loader) {
+  uint8_t usercode[4];
+  bool done;
+
+  return loader_read_usercode(loader, usercode, &done) && done &&
+         jtag_bits_match(usercode, loader->bridge_usercode, NULL, 32);
+}
+
+// Read USERCODE without leaving RUN_TEST_IDLE, a TEST_LOGIC_RESET would
+// upset the bridge. done is set from the DONE bit captured in IR.
+bool loader_read_usercode(struct loader_ctx *loader, uint8_t *usercode,
+                          bool *done) {
+  uint8_t status;
+
+  if (!loader_capture_IR(loader, USERCODE, &status) ||
+      !loader_capture_DR(loader, 32, zero_word, usercode))
     return false;
-  if (!loader_set_state(loader, TEST_LOGIC_RESET))
+  if (done != NULL)
+    *done = (status & IR_DONE) != 0;
+  return true;
+}
+
+// Reboot the FPGA from flash if the bridge is still loaded
+bool loader_release_bridge(struct loader_ctx *loader) {
+  if (loader->bridge == NULL)
+    return true;
+  loader->bridge = NULL;
+
+  if (!loader_set_IR(loader, JPROGRAM))
     return false;
-  if (!jtag_send_clocks(loader->device, 5))
+
+  // reset just for good measure
+  if (!loader_reset_state(loader))
     return false;
 
-  return true;
+  return jtag_flush(loader->device);
 }
 
 bool loader_erase_flash(struct loader_ctx *loader, char *loader_file) {
-  fprintf(stdout, "Initializing FPGA...\n");
-  if (!loader_load_bin(loader, loader_file)) {
-    fprintf(stdout, "Failed to initialize FPGA!\n");
-    return false;
-  }
-
-  if (!jtag_set_freq(loader->device, 1500000)) {
-    fprintf(stderr, "Failed to set JTAG frequency!\n");
+  if (!loader_open_bridge(loader, loader_file))
     return false;
-  }
 
   fprintf(stdout, "Erasing...\n");
 
@@ -175,18 +342,14 @@ bool loader_erase_flash(struct loader_ctx *loader, char *loader_file) {
   if (!loader_set_IR(loader, USER1))
     return false;
 
-  if (!loader_shift_DR(loader, 1, "0", "", "", false))
+  if (!loader_shift_DR(loader, 1, zero_word, NULL, NULL))
     return false;
 
-  usleep(10000000);
-
-  if (!loader_set_IR(loader, JPROGRAM))
+  if (!jtag_flush(loader->device))
     return false;
-
-  // reset just for good measure
-  if (!loader_reset_state(loader)) {
-    return false;
-  }
+  // The bridge has no status that can be polled, any USER1/USER2 scan ends
+  // in UPDATE_DR and starts a new command, so the erase gets a fixed time
+  usleep(10000000);
 
   return true;
 }
@@ -194,16 +357,8 @@ bool loader_erase_flash(struct loader_ctx *loader, char *loader_file) {
 bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
                       char *loader_file) {
   if (flash) {
-    fprintf(stdout, "Initializing FPGA...\n");
-    if (!loader_load_bin(loader, loader_file)) {
-      fprintf(stderr, "Failed to initialize FPGA!\n");
+    if (!loader_open_bridge(loader, loader_file))
       return false;
-    }
-
-    if (!jtag_set_freq(loader->device, 1500000)) {
-      fprintf(stderr, "Failed to set JTAG frequency!\n");
-      return false;
-    }
 
     fprintf(stdout, "Erasing...\n");
 
@@ -211,9 +366,11 @@ bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
     if (!loader_set_IR(loader, USER1))
       return false;
 
-    if (!loader_shift_DR(loader, 0, "0", "", "", false))
+    if (!loader_shift_DR(loader, 0, zero_word, NULL, NULL))
       return false;
 
+    if (!jtag_flush(loader->device))
+      return false;
     usleep(100000);
 
     fprintf(stdout, "Writing...\n");
@@ -222,7 +379,7 @@ bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
     if (!loader_set_IR(loader, USER2))
       return false;
 
-    if (!loader_shift_DR(loader, 0, bin_file, "", "", true)) {
+    if (!loader_shift_file(loader, bin_file, false)) {
       return false;
     }
 
@@ -232,9 +389,12 @@ bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
     // state. You need to do this before issuing a
     // JPROGRAM command or the FPGA can't read the
     // flash.
+    loader->bridge = NULL;
     if (!loader_reset_state(loader))
       return false;
 
+    if (!jtag_flush(loader->device))
+      return false;
     usleep(100000); // 100ms delay is required before issuing JPROGRAM
 
     fprintf(stdout, "Resetting FPGA...\n");
@@ -254,17 +414,400 @@ bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
   if (!loader_reset_state(loader))
     return false;
 
+  if (!jtag_flush(loader->device))
+    return false;
+
   fprintf(stdout, "Done.\n");
   return true;
 }
 
+// Run an SVF or XSVF file, a vendor flash or test flow say, at config_freq
+// unless it sets its own. A loaded bridge is released first as the file
+// may well reconfigure the FPGA.
+bool loader_play_svf(struct loader_ctx *loader, char *svf_file) {
+  fprintf(stdout, "Playing %s...\n", svf_file);
+  if (!loader_release_bridge(loader))
+    return false;
+
+  if (!jtag_set_freq(loader->device, loader->config_freq)) {
+    fprintf(stderr, "Failed to set JTAG frequency!\n");
+    return false;
+  }
+
+  if (!svf_play_file(loader->device, svf_file))
+    return false;
+
+  // The TAP is wherever the file left it
+  if (!loader_reset_state(loader) || !jtag_flush(loader->device))
+    return false;
+
+  fprintf(stdout, "Done.\n");
+  return true;
+}
+
+// Read the configuration back and compare it with the frames in bin_file.
+// Bits set in the frames of mask_file, a Vivado .msk, are ignored.
+bool loader_verify_bin(struct loader_ctx *loader, char *bin_file,
+                       char *mask_file) {
+  struct image *img, *msk = NULL;
+  bool ret = false;
+
+  fprintf(stdout, "Verifying FPGA...\n");
+  if ((img = image_open(bin_file)) == NULL)
+    return false;
+  if (mask_file == NULL || (msk = image_open(mask_file)) != NULL)
+    ret = loader_verify_frames(loader, img, msk);
+
+  if (msk)
+    image_close(msk);
+  image_close(img);
+  return ret;
+}
+
+bool loader_verify_frames(struct loader_ctx *loader, const struct image *img,
+                          const struct image *msk) {
+  struct frame_check check = {0};
+  uint32_t far, mask_far;
+  size_t words, mask_words;
+  bool ready;
+
+  if (!find_frames(img, &far, &check.data, &words) || words <= FRAME_WORDS) {
+    fprintf(stderr, "No configuration frames in %s!\n", img->path);
+    return false;
+  }
+  if (msk && (!find_frames(msk, &mask_far, &check.mask, &mask_words) ||
+              mask_far != far || mask_words != words)) {
+    fprintf(stderr, "%s isn't a mask for %s!\n", msk->path, img->path);
+    return false;
+  }
+  // The last frame written only pushes the one before it out of the frame
+  // buffer
+  check.size = (words - FRAME_WORDS) * 4;
+  check.progress = &loader->device->progress;
+
+  // After a flash write the FPGA may still be loading itself
+  if (!jtag_set_freq(loader->device, loader->config_freq) ||
+      !loader_reset_state(loader) ||
+      !loader_poll_IR(loader, BYPASS, IR_DONE, IR_DONE, BOOT_POLLS, 0,
+                      &ready))
+    return false;
+  if (!ready) {
+    fprintf(stderr, "FPGA isn't configured!\n");
+    return false;
+  }
+  if (!loader_check_stat(loader) ||
+      !loader_readback(loader, far, words + FRAME_WORDS, verify_frames,
+                       &check))
+    return false;
+
+  if (check.errors > 0) {
+    fprintf(stderr,
+            "Readback differs in %zu words, first in frame %zu word %zu: "
+            "read %08X, expected %08X\n",
+            check.errors, check.first / FRAME_WORDS,
+            check.first % FRAME_WORDS, check.read, check.expected);
+    return false;
+  }
+  fprintf(stdout, "Verified %zu frames.\n", words / FRAME_WORDS - 1);
+  return true;
+}
+
 bool loader_check_IDCODE(struct loader_ctx *loader) {
   if (!loader_set_IR(loader, IDCODE))
     return false;
 
-  if (!loader_shift_DR(loader, 32, "00000000", "0362D093",
-                       "0FFFFFFF", false)) // FPGA IDCODE
+  if (!loader_shift_DR(loader, 32, zero_word, idcode, idcode_mask))
+    return false;
+
+  return true;
+}
+
+bool loader_capture_DR(struct loader_ctx *loader, int bits,
+                       const uint8_t *write, uint8_t *read) {
+  if (!jtag_navigate_to_state(loader->device, loader->current_state,
+                              SHIFT_DR)) {
+    fprintf(stderr, "Failed to change to SHIFT_DR state!\n");
+    return false;
+  }
+  jtag_shift_exit(loader->device, EXIT1_DR, RUN_TEST_IDLE);
+  if (!jtag_shift(loader->device, bits, write, read)) {
+    fprintf(stderr, "Failed to shift data!\n");
+    return false;
+  }
+  loader->current_state = RUN_TEST_IDLE;
+  return true;
+}
+
+bool loader_capture_IR(struct loader_ctx *loader, enum instruction inst,
+                       uint8_t *status) {
+  uint8_t ir = inst;
+
+  if (!jtag_navigate_to_state(loader->device, loader->current_state,
+                              SHIFT_IR)) {
+    fprintf(stderr, "Failed to change to SHIFT_IR state!\n");
+    return false;
+  }
+  jtag_shift_exit(loader->device, EXIT1_IR, RUN_TEST_IDLE);
+  if (!jtag_shift(loader->device, 6, &ir, status)) {
+    fprintf(stderr, "Failed to shift instruction data!\n");
+    return false;
+  }
+  loader->current_state = RUN_TEST_IDLE;
+  return true;
+}
+
+// Load inst until the status captured in IR matches want under mask, at most
+// polls times. Between polls either clocks TCKs are sent in RUN_TEST_IDLE
+// or, when clocks is 0, the host sleeps INIT_POLL_US. ready tells whether
+// the status was seen before running out of polls.
+bool loader_poll_IR(struct loader_ctx *loader, enum instruction inst,
+                    uint8_t want, uint8_t mask, int polls,
+                    unsigned long clocks, bool *ready) {
+  uint8_t status;
+
+  *ready = false;
+  for (int i = 0; i < polls; i++) {
+    if (clocks > 0) {
+      if (!jtag_send_clocks(loader->device, clocks))
+        return false;
+    } else if (i > 0) {
+      usleep(INIT_POLL_US);
+    }
+    if (!loader_capture_IR(loader, inst, &status))
+      return false;
+    if ((status & mask) == want) {
+      *ready = true;
+      return true;
+    }
+  }
+  return true;
+}
+
+bool loader_read_idcode(struct loader_ctx *loader, uint8_t *id) {
+  return loader_reset_state(loader) && loader_set_IR(loader, IDCODE) &&
+         loader_capture_DR(loader, 32, zero_word, id);
+}
+
+// Read the configuration STAT register the same way loader_load_bin()
+// checks it
+bool loader_read_stat(struct loader_ctx *loader, uint8_t *stat) {
+  return loader_set_state(loader, TEST_LOGIC_RESET) &&
+         jtag_send_clocks(loader->device, 5) &&
+         loader_set_IR(loader, CFG_IN) &&
+         loader_shift_DR(loader, 160, stat_read, NULL, NULL) &&
+         loader_set_IR(loader, CFG_OUT) &&
+         loader_capture_DR(loader, 32, zero_word, stat) &&
+         loader_set_state(loader, TEST_LOGIC_RESET);
+}
+
+// STAT as a register value from its bits captured through CFG_OUT
+uint32_t stat_word(const uint8_t *stat) {
+  return (uint32_t)bitrev_byte(stat[0]) << 24 |
+         (uint32_t)bitrev_byte(stat[1]) << 16 |
+         (uint32_t)bitrev_byte(stat[2]) << 8 | bitrev_byte(stat[3]);
+}
+
+// Fail unless STAT shows a finished configuration without CRC errors
+bool loader_check_stat(struct loader_ctx *loader) {
+  uint8_t raw[4];
+
+  if (!loader_read_stat(loader, raw) || !jtag_send_clocks(loader->device, 5))
     return false;
 
+  uint32_t stat = stat_word(raw);
+  if ((stat & (STAT_CONFIGURED | STAT_CRC_ERROR)) != STAT_CONFIGURED) {
+    fprintf(stderr,
+            "Configuration failed, STAT %08X (CRC error %d, INIT %d, "
+            "DONE %d, EOS %d)!\n",
+            stat, (stat & STAT_CRC_ERROR) != 0,
+            (stat & STAT_INIT_COMPLETE) != 0, (stat & STAT_DONE) != 0,
+            (stat & STAT_EOS) != 0);
+    return false;
+  }
   return true;
 }
+
+// Configuration words as CFG_IN bits, MSB of the first word first
+void cfg_bits(uint8_t *dst, const uint32_t *words, int n) {
+  for (int i = 0; i < n; i++) {
+    for (int b = 0; b < 4; b++)
+      *dst++ = bitrev_byte(words[i] >> (24 - 8 * b));
+  }
+}
+
+// Find the frame data a bitstream writes to FDRI and the frame address it
+// starts at. Only the first FDRI write is used, compressed bitstreams that
+// repeat frames with MFW aren't supported.
+bool find_frames(const struct image *img, uint32_t *far, const uint8_t **data,
+                 size_t *words) {
+  const uint8_t *p = img->data, *end = img->data + img->size;
+  int reg = -1;
+
+  *far = 0;
+  while (p + 4 <= end &&
+         ((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) != CFG_SYNC)
+    p++;
+
+  for (p += 4; p + 4 <= end; p += 4) {
+    uint32_t w = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+    uint32_t type = w >> 29, op = (w >> 27) & 3;
+    size_t count;
+
+    if (type == CFG_TYPE1) {
+      reg = (w >> 13) & 0x1F;
+      count = w & 0x7FF;
+    } else if (type == CFG_TYPE2) {
+      count = w & 0x7FFFFFF;
+    } else {
+      continue;
+    }
+    if (op != CFG_WRITE || count == 0)
+      continue;
+    if ((size_t)(end - p - 4) < count * 4)
+      break;
+
+    if (reg == CFG_FAR) {
+      *far = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+    } else if (reg == CFG_FDRI) {
+      *data = p + 4;
+      *words = count;
+      return true;
+    }
+    p += count * 4;
+  }
+  return false;
+}
+
+bool verify_frames(void *arg, const uint8_t *tdo, size_t n) {
+  struct frame_check *check = arg;
+  const size_t pad = FRAME_WORDS * 4;
+
+  for (size_t i = 0; i < n; i++, check->pos++) {
+    size_t k = check->pos - pad;
+    if (check->pos < pad || k >= check->size)
+      continue;
+
+    uint8_t value = bitrev_byte(tdo[i]);
+    uint8_t diff = value ^ check->data[k];
+    if (check->mask)
+      diff &= ~check->mask[k];
+    check->word = check->word << 8 | value;
+    check->diff |= diff;
+    if (k % 4 != 3)
+      continue;
+
+    if (check->diff != 0 && check->errors++ == 0) {
+      const uint8_t *e = check->data + k - 3;
+      check->first = k / 4;
+      check->read = check->word;
+      check->expected = (uint32_t)e[0] << 24 | e[1] << 16 | e[2] << 8 | e[3];
+    }
+    check->diff = 0;
+  }
+
+  size_t done = check->pos > pad ? check->pos - pad : 0;
+  progress_report(check->progress, done < check->size ? done : check->size,
+                  check->size);
+  return true;
+}
+
+// Read words of configuration frames starting at far through CFG_OUT,
+// streaming them to fn. The readback starts with one pad frame.
+bool loader_readback(struct loader_ctx *loader, uint32_t far, size_t words,
+                     jtag_tdo_fn fn, void *arg) {
+  const uint32_t start[] = {
+      CFG_DUMMY, CFG_SYNC, CFG_NOOP, TYPE1(CFG_WRITE, CFG_CMD, 1), CMD_RCRC,
+      CFG_NOOP, CFG_NOOP, TYPE1(CFG_WRITE, CFG_CMD, 1), CMD_RCFG, CFG_NOOP,
+      TYPE1(CFG_WRITE, CFG_FAR, 1), far, TYPE1(CFG_READ, CFG_FDRO, 0),
+      TYPE2(CFG_READ, words), CFG_NOOP, CFG_NOOP};
+  const uint32_t finish[] = {TYPE1(CFG_WRITE, CFG_CMD, 1), CMD_DESYNC,
+                             CFG_NOOP, CFG_NOOP};
+  uint8_t bits[sizeof(start)];
+
+  if (!loader_set_state(loader, TEST_LOGIC_RESET) ||
+      !jtag_send_clocks(loader->device, 5) || !loader_set_IR(loader, CFG_IN))
+    return false;
+  cfg_bits(bits, start, sizeof(start) / 4);
+  if (!loader_shift_DR(loader, sizeof(start) * 8, bits, NULL, NULL) ||
+      !loader_set_IR(loader, CFG_OUT))
+    return false;
+
+  if (!jtag_navigate_to_state(loader->device, loader->current_state,
+                              SHIFT_DR)) {
+    fprintf(stderr, "Failed to change to SHIFT_DR state!\n");
+    return false;
+  }
+  jtag_shift_exit(loader->device, EXIT1_DR, RUN_TEST_IDLE);
+  if (!jtag_shift_stream(loader->device, words * 32, NULL, fn, arg)) {
+    fprintf(stderr, "Failed to read configuration frames!\n");
+    return false;
+  }
+  loader->current_state = RUN_TEST_IDLE;
+
+  cfg_bits(bits, finish, sizeof(finish) / 4);
+  return loader_set_IR(loader, CFG_IN) &&
+         loader_shift_DR(loader, sizeof(finish) * 8, bits, NULL, NULL) &&
+         loader_set_state(loader, TEST_LOGIC_RESET) &&
+         jtag_flush(loader->device);
+}
+
+// Whether IDCODE and STAT read back the same as at a slow, known good TCK
+bool loader_test_freq(struct loader_ctx *loader, double freq,
+                      const uint8_t *ref_id, const uint8_t *ref_stat) {
+  uint8_t id[4], stat[4];
+
+  if (!jtag_set_freq(loader->device, freq))
+    return false;
+
+  for (int r = 0; r < TUNE_ROUNDS; r++) {
+    if (!loader_read_idcode(loader, id) ||
+        !jtag_bits_match(id, ref_id, NULL, 32))
+      return false;
+    if (r % 4 == 0 && (!loader_read_stat(loader, stat) ||
+                       !jtag_bits_match(stat, ref_stat, NULL, 32)))
+      return false;
+  }
+  return true;
+}
+
+// Find the fastest TCK that reads IDCODE and STAT back reliably, starting
+// from guess when it's given. Leaves config_freq set to the result.
+bool loader_tune_freq(struct loader_ctx *loader, double guess, double *best) {
+  uint8_t ref_id[4], ref_stat[4];
+
+  *best = 0;
+  if (!jtag_set_freq(loader->device, tune_steps[0]) ||
+      !loader_read_idcode(loader, ref_id) ||
+      !loader_read_stat(loader, ref_stat))
+    return false;
+
+  if (!jtag_bits_match(ref_id, idcode, idcode_mask, 32)) {
+    fprintf(stderr, "No FPGA found at %.1f MHz!\n", tune_steps[0] / 1e6);
+    return false;
+  }
+
+  // A frequency that worked before only needs checking
+  if (guess > 0 && loader_test_freq(loader, guess, ref_id, ref_stat)) {
+    *best = loader->device->freq;
+  } else {
+    fprintf(stdout, "Tuning TCK...\n");
+    for (int k = 0; k < N_TUNE_STEPS; k++) {
+      bool ok = loader_test_freq(loader, tune_steps[k], ref_id, ref_stat);
+      fprintf(stdout, "  %5.1f MHz: %s\n", tune_steps[k] / 1e6,
+              ok ? "ok" : "failed");
+      if (!ok)
+        break;
+      *best = loader->device->freq;
+    }
+  }
+
+  if (*best == 0) {
+    fprintf(stderr, "JTAG doesn't work reliably at %.1f MHz!\n",
+            tune_steps[0] / 1e6);
+    return false;
+  }
+
+  fprintf(stdout, "Using %.1f MHz TCK\n", *best / 1e6);
+  loader->config_freq = *best;
+  return loader_reset_state(loader) && jtag_set_freq(loader->device, *best);
+}
@@ -37,17 +37,29 @@ enum instruction {
   BYPASS = 0x2F,
 };
 
+#define LOADER_CONFIG_FREQ 10e6 // TCK while configuring the FPGA
+#define LOADER_BRIDGE_FREQ 1.5e6 // TCK while talking to the flash bridge
+
 struct loader_ctx {
   struct jtag_ctx *device;
   enum jtag_fsm_state current_state;
+  double config_freq;
+  double bridge_freq;
+  const char *bridge;         // flash bridge currently loaded, or NULL
+  uint8_t bridge_usercode[4]; // its USERCODE, to tell it's still there
 };
 
 struct loader_ctx *loader_new(struct jtag_ctx *jtag);
 bool loader_reset_state(struct loader_ctx *loader);
 bool loader_check_IDCODE(struct loader_ctx *loader);
+bool loader_tune_freq(struct loader_ctx *loader, double guess, double *best);
+bool loader_release_bridge(struct loader_ctx *loader);
 bool loader_erase_flash(struct loader_ctx *loader, char *loader_file);
 bool loader_write_bin(struct loader_ctx *loader, char *bin_file, bool flash,
                       char *loader_file);
+bool loader_verify_bin(struct loader_ctx *loader, char *bin_file,
+                       char *mask_file);
+bool loader_play_svf(struct loader_ctx *loader, char *svf_file);
 
 #ifdef __cplusplus
 }
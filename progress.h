@@ -0,0 +1,27 @@
+#ifndef PROGRESS_H_
+#define PROGRESS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+// Told how far a long transfer has got, done out of total bytes
+typedef void (*progress_fn)(void *arg, size_t done, size_t total);
+
+struct progress {
+  progress_fn fn; // NULL for no reports
+  void *arg;
+};
+
+static inline void progress_report(const struct progress *p, size_t done,
+                                   size_t total) {
+  if (p->fn)
+    p->fn(p->arg, done, total);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* PROGRESS_H_ */
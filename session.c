@@ -0,0 +1,303 @@
+#include "session.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tck.h"
+
+// A thread running a job on one of several sessions
+struct worker {
+  struct session *s;
+  const struct options *opt;
+  pthread_t thread;
+  bool started;
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop(int sig);
+static bool au_steps(struct session *s, const struct options *opt);
+static bool cu_steps(struct session *s, const struct options *opt);
+static void *session_thread(void *arg);
+
+// Monotonic time for measuring how long things take
+double session_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void on_stop(int sig) { stop_requested = 1; }
+
+// Have SIGINT and SIGTERM set session_stopping() for the loops that run
+// until then. There's no SA_RESTART, so a blocking call the signal lands
+// in returns early for the loop to notice.
+void session_catch_stop(void) {
+  struct sigaction sa = {.sa_handler = on_stop};
+
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+}
+
+bool session_stopping(void) { return stop_requested; }
+
+// Open the board and bring its MPSSE up for JTAG (Au) or SPI (Cu)
+bool session_open(struct session *s) {
+  if ((s->ftdi = ftdi_new()) == NULL) {
+    fprintf(stderr, "Failed to allocate ftdi structure for board %u!\n",
+            s->index);
+    return false;
+  }
+  if (!board_open(s->ftdi, &s->info)) {
+    ftdi_free(s->ftdi);
+    s->ftdi = NULL;
+    return false;
+  }
+
+  if (s->info.type == BOARD_AU) {
+    s->jtag = jtag_new(s->ftdi);
+    if (jtag_initialize(s->jtag) == false) {
+      fprintf(stderr, "Failed to initialize JTAG!\n");
+      session_close(s);
+      return false;
+    }
+    s->loader = loader_new(s->jtag);
+  } else {
+    s->spi = spi_new(s->ftdi);
+    if (spi_initialize(s->spi) == false) {
+      fprintf(stderr, "Failed to initialize SPI!\n");
+      session_close(s);
+      return false;
+    }
+  }
+  return true;
+}
+
+void session_close(struct session *s) {
+  if (s->ftdi == NULL)
+    return;
+
+  jtag_shutdown(s->jtag);
+  free(s->loader);
+  spi_shutdown(s->spi);
+  ftdi_usb_close(s->ftdi);
+  ftdi_free(s->ftdi);
+
+  s->ftdi = NULL;
+  s->jtag = NULL;
+  s->loader = NULL;
+  s->spi = NULL;
+}
+
+bool au_steps(struct session *s, const struct options *opt) {
+  struct loader_ctx *loader = s->loader;
+  const char *key = board_key(&s->info);
+
+  loader->config_freq = opt->config_freq;
+  loader->bridge_freq = opt->bridge_freq;
+
+  if (opt->tune) {
+    double saved = 0, best;
+    tck_load(key, &saved);
+    if (!loader_tune_freq(loader, saved, &best)) {
+      fprintf(stderr, "Failed to tune JTAG frequency!\n");
+      return false;
+    }
+    if (best != saved && key[0])
+      tck_save(key, best);
+  }
+
+  /*
+  if (!loader_check_IDCODE(loader)) {
+    fprintf(stderr, "IDCODE check failed!\n");
+    return false;
+  }
+  */
+
+  if (opt->erase) {
+    if (!loader_erase_flash(loader, opt->au_bridge_bin)) {
+      fprintf(stderr, "Failed to erase flash!\n");
+      return false;
+    }
+  }
+
+  if (opt->fpga_flash) {
+    if (!loader_write_bin(loader, opt->fpga_bin_flash, true,
+                          opt->au_bridge_bin)) {
+      fprintf(stderr, "Failed to write FPGA flash!\n");
+      return false;
+    }
+  }
+
+  if (opt->fpga_ram) {
+    if (!loader_write_bin(loader, opt->fpga_bin_ram, false, NULL)) {
+      fprintf(stderr, "Failed to write FPGA RAM!\n");
+      return false;
+    }
+  }
+
+  if (opt->svf) {
+    if (!loader_play_svf(loader, opt->svf_file)) {
+      fprintf(stderr, "Failed to play %s!\n", opt->svf_file);
+      return false;
+    }
+  }
+
+  if (opt->fpga_verify) {
+    if (!loader_verify_bin(loader, opt->fpga_bin_verify, opt->mask_file)) {
+      fprintf(stderr, "Failed to verify FPGA configuration!\n");
+      return false;
+    }
+  }
+
+  if (opt->fpga_dump) {
+    fprintf(stderr, "Alchitry Au doesn't support flash readback!\n");
+  }
+
+  if (!loader_release_bridge(loader)) {
+    fprintf(stderr, "Failed to reset FPGA!\n");
+    return false;
+  }
+  return true;
+}
+
+// Unlike on the Au, a failed step doesn't stop the ones after it
+bool cu_steps(struct session *s, const struct options *opt) {
+  struct spi_ctx *spi = s->spi;
+  bool ok = true;
+
+  spi->incremental = opt->incremental;
+
+  if (opt->erase) {
+    if (!spi_erase_flash(spi)) {
+      fprintf(stderr, "Failed to erase flash!\n");
+      ok = false;
+    } else {
+      fprintf(stdout, "Done.\n");
+    }
+  }
+
+  if (opt->fpga_flash) {
+    if (!spi_write_bin(spi, opt->fpga_bin_flash)) {
+      fprintf(stderr, "Failed to write FPGA flash!\n");
+      ok = false;
+    }
+  }
+
+  if (opt->fpga_verify) {
+    if (!spi_verify_bin(spi, opt->fpga_bin_verify)) {
+      fprintf(stderr, "Failed to verify FPGA flash!\n");
+      ok = false;
+    }
+  }
+
+  if (opt->fpga_dump) {
+    if (!spi_read_flash(spi, opt->fpga_bin_dump, 0)) {
+      fprintf(stderr, "Failed to read FPGA flash!\n");
+      ok = false;
+    }
+  }
+
+  if (opt->fpga_ram) {
+    if (!spi_load_ram(spi, opt->fpga_bin_ram)) {
+      fprintf(stderr, "Failed to write FPGA RAM!\n");
+      ok = false;
+    }
+  }
+
+  if (opt->svf) {
+    fprintf(stderr, "Alchitry Cu has no JTAG to play SVF files on!\n");
+  }
+
+  return ok;
+}
+
+// Run the steps asked for on the board, opening the session first if it
+// isn't open yet. A session that fails is closed, whatever went wrong may
+// have left the MPSSE in any state.
+bool session_run(struct session *s, const struct options *opt) {
+  double start = session_seconds();
+  unsigned long long before;
+
+  s->ok = false;
+  s->usb_bytes = 0;
+  if (s->info.type != BOARD_AU && s->info.type != BOARD_CU) {
+    fprintf(stderr, "Unknown board type!\n");
+  } else if (s->info.type == BOARD_AU && opt->au_bridge_bin == NULL &&
+             (opt->erase || opt->fpga_flash)) {
+    fprintf(stderr, "No Au bridge bin provided!\n");
+  } else if (s->ftdi != NULL || session_open(s)) {
+    if (s->info.type == BOARD_AU) {
+      before = s->jtag->usb_bytes;
+      s->ok = au_steps(s, opt);
+      s->usb_bytes = s->jtag->usb_bytes - before;
+    } else {
+      before = s->spi->flushed_bytes;
+      s->ok = cu_steps(s, opt);
+      s->usb_bytes = s->spi->flushed_bytes - before;
+    }
+    if (!s->ok)
+      session_close(s);
+  }
+
+  s->secs = session_seconds() - start;
+  return s->ok;
+}
+
+void *session_thread(void *arg) {
+  struct worker *w = arg;
+
+  session_run(w->s, w->opt);
+  return NULL;
+}
+
+// Run a job on every session at once, one thread each. Transfers to
+// different FTDIs don't wait on each other, so this takes about as long as
+// the slowest board does by itself.
+bool session_run_all(struct session *sessions, int n,
+                     const struct options *opt) {
+  unsigned long long bytes = 0;
+  int i, done = 0;
+
+  struct worker *workers = calloc(n, sizeof(struct worker));
+  if (workers == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+
+  double start = session_seconds();
+  for (i = 0; i < n; i++) {
+    struct worker *w = &workers[i];
+    struct session *s = &sessions[i];
+    w->s = s;
+    w->opt = opt;
+    s->ok = false;
+    fprintf(stdout, "Starting board %d (%s %s at %s)\n", i,
+            board_name(s->info.type), s->info.serial, s->info.path);
+    w->started = pthread_create(&w->thread, NULL, session_thread, w) == 0;
+    if (!w->started)
+      fprintf(stderr, "Failed to start a thread for board %d!\n", i);
+  }
+  for (i = 0; i < n; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+  }
+  double secs = session_seconds() - start;
+  free(workers);
+
+  for (i = 0; i < n; i++) {
+    struct session *s = &sessions[i];
+    fprintf(stdout, "Board %d (%s %s): %s after %.1f s, %.1f MB over USB\n",
+            i, board_name(s->info.type), s->info.serial,
+            s->ok ? "done" : "FAILED", s->secs, s->usb_bytes / 1e6);
+    done += s->ok;
+    bytes += s->usb_bytes;
+  }
+  fprintf(stdout, "%d of %d boards done in %.1f s, %.2f MB/s over USB\n",
+          done, n, secs, secs > 0 ? bytes / secs / 1e6 : 0);
+
+  return done == n;
+}
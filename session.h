@@ -0,0 +1,67 @@
+#ifndef SESSION_H_
+#define SESSION_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ftdi.h>
+#include <stdbool.h>
+
+#include "boards.h"
+#include "jtag.h"
+#include "loader.h"
+#include "spi.h"
+
+// What to do with a board
+struct options {
+  bool erase;
+  bool fpga_flash;
+  bool fpga_ram;
+  bool fpga_verify;
+  bool fpga_dump;
+  bool svf;
+  bool incremental;
+  bool tune;
+  char *fpga_bin_flash;
+  char *fpga_bin_ram;
+  char *fpga_bin_verify;
+  char *fpga_bin_dump;
+  char *mask_file;
+  char *svf_file;
+  char *au_bridge_bin; // NULL when not provided
+  double config_freq;
+  double bridge_freq;
+};
+
+// A board and, while it's open, the initialized MPSSE link to it. Jobs run
+// on an open session skip the USB reset, MPSSE setup and settle time.
+struct session {
+  unsigned int index; // in the board list, for messages
+  struct board_info info;
+
+  struct ftdi_context *ftdi; // NULL while closed
+  struct jtag_ctx *jtag;     // Au
+  struct loader_ctx *loader; // Au
+  struct spi_ctx *spi;       // Cu
+
+  // outcome of the last session_run()
+  bool ok;
+  double secs;
+  unsigned long long usb_bytes;
+};
+
+bool session_open(struct session *s);
+void session_close(struct session *s);
+bool session_run(struct session *s, const struct options *opt);
+bool session_run_all(struct session *sessions, int n,
+                     const struct options *opt);
+
+double session_seconds(void);
+void session_catch_stop(void);
+bool session_stopping(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SESSION_H_ */
@@ -1,16 +1,64 @@
 #include "spi.h"
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LATENCY_MS 2
 #define CHUNK_SIZE 65535
 #define USB_TIMEOUT 5000
+#define BUF_SIZE 4096
+#define MAX_XFER 65536
+
+/* What a sector (smallest erase unit) needs during a write */
+#define SECTOR_CLEAN 0
+#define SECTOR_PROGRAM 1
+#define SECTOR_ERASE 2
+
+#define ERASE_OVERHEAD_US 1000L // write enable, command and first poll
+
+#define PLAN_INF (1LL << 60)
+
+/* Busy polling, see flash_wait() */
+#define SCK_BYTES_PER_MS 3750 // 30 MHz SCK, see config_spi()
+#define POLL_SAMPLES 8        // status reads per USB round trip
+#define POLL_MIN_GAP_US 4
+#define POLL_MAX_GAP_US 1000
+#define POLL_SLEEP_US 5000 // wait longer than this on the host
+
+typedef bool (*flash_sink)(void *arg, long offset, const uint8_t *data, int n);
+
+struct erase_op {
+  uint8_t cmd;
+  int addr;
+  int size;
+};
+
+struct erase_plan {
+  const struct flash_info *flash;
+  int sector_size; // smallest erase size
+  int sectors;     // sectors on the chip
+  uint8_t *state; // SECTOR_* per sector
+  // extra programming time in us if the sector gets erased although it
+  // doesn't need to be, -1 when its contents must be preserved
+  long *penalty;
+  struct erase_op *ops;
+  int n_ops;
+  long long est_us;
+};
 
 static void check_rx(struct spi_ctx *);
-static void error(struct spi_ctx *, int);
+static void error(struct spi_ctx *);
+static void queue_cmd(struct spi_ctx *, const uint8_t *data, int n);
+static void flush_cmds(struct spi_ctx *);
+static void read_data(struct spi_ctx *, uint8_t *data, int n);
+static void print_usb_stats(struct spi_ctx *);
+static void crc32_init(void);
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, int n);
+static double elapsed(struct timespec *start);
 static void send_spi(struct spi_ctx *, uint8_t *data, int n);
 static void xfer_spi(struct spi_ctx *, uint8_t *data, int n);
 static uint8_t xfer_spi_bits(struct spi_ctx *, uint8_t data, int n);
@@ -19,15 +67,34 @@ static int get_cdone(struct spi_ctx *);
 static void flash_chip_select(struct spi_ctx *);
 static void flash_chip_deselect(struct spi_ctx *);
 static void flash_read_id(struct spi_ctx *);
+static void flash_detect(struct spi_ctx *);
+static int flash_addr(struct spi_ctx *, uint8_t *buf, uint8_t cmd, long addr);
 static void flash_reset(struct spi_ctx *);
 static void flash_power_up(struct spi_ctx *);
 static void flash_power_down(struct spi_ctx *);
 static uint8_t flash_read_status(struct spi_ctx *);
 static void flash_write_enable(struct spi_ctx *);
-static void flash_bulk_erase(struct spi_ctx *);
-static void flash_64kB_sector_erase(struct spi_ctx *, int addr);
-static void flash_prog(struct spi_ctx *, int addr, uint8_t *data, int n);
-static void flash_wait(struct spi_ctx *);
+static void flash_erase(struct spi_ctx *, uint8_t cmd, long addr);
+static void flash_prog(struct spi_ctx *, long addr, uint8_t *data, int n);
+static void flash_read(struct spi_ctx *, long addr, uint8_t *data, long n);
+static bool flash_read_stream(struct spi_ctx *, long addr, long n,
+                              flash_sink sink, void *arg);
+static void flash_enter(struct spi_ctx *);
+static void flash_leave(struct spi_ctx *);
+static void queue_delay(struct spi_ctx *, uint32_t us);
+static int flash_poll(struct spi_ctx *, uint32_t lead_us, uint32_t gap_us);
+static bool flash_wait(struct spi_ctx *, uint32_t typ_us, uint32_t max_us);
+static bool read_file(const char *filename, uint8_t **data, long *size);
+static void diff_sectors(struct spi_ctx *, int sector_size, long offset,
+                         uint8_t *image, long size, uint8_t *current,
+                         uint8_t *state);
+static bool page_erased(const uint8_t *data, int n);
+static bool page_needs_prog(uint8_t state, const uint8_t *image,
+                            const uint8_t *current, int n);
+static bool plan_init(struct erase_plan *, const struct flash_info *);
+static void plan_free(struct erase_plan *);
+static void plan_erase(struct spi_ctx *, struct erase_plan *);
+static bool run_plan(struct spi_ctx *, struct erase_plan *);
 
 static bool sync_mpsse(struct ftdi_context *ftdi);
 static bool config_spi(struct ftdi_context *ftdi);
@@ -107,6 +174,8 @@ enum flash_cmd {
   FC_QPI = 0x38,     /* Enter QPI mode */
   FC_ERESET = 0x66,  /* Enable Reset */
   FC_RESET = 0x99,   /* Reset Device */
+  FC_EN4B = 0xB7,    /* Enter 4-Byte Address Mode */
+  FC_EX4B = 0xE9,    /* Exit 4-Byte Address Mode */
 };
 
 struct spi_ctx *spi_new(struct ftdi_context *ftdi) {
@@ -156,8 +225,11 @@ bool spi_initialize(struct spi_ctx *spi) {
 void spi_shutdown(struct spi_ctx *spi) {
   if (spi) {
     if (spi->active) {
+      spi->active = false;
+      flush_cmds(spi);
       ftdi_set_bitmode(spi->ftdi, 0, BITMODE_RESET);
     }
+    free(spi->buf);
     free(spi);
     spi = NULL;
   }
@@ -271,40 +343,130 @@ void check_rx(struct spi_ctx *spi) {
   }
 }
 
-void error(struct spi_ctx *spi, int status) {
+// Give up on the device after a failed transfer. Later commands are
+// dropped and reads return zeros, so whatever is running winds down
+// quickly and the spi_* call it came from returns false.
+void error(struct spi_ctx *spi) {
   check_rx(spi);
   fprintf(stderr, "ABORT.\n");
-  if (spi->active)
-    spi_shutdown(spi);
-  exit(status);
+  spi->buf_len = 0;
+  spi->failed = true;
 }
 
-void send_spi(struct spi_ctx *spi, uint8_t *data, int n) {
-  unsigned char cmd[3];
-  int cmdlen = 3;
+// Append raw MPSSE bytes to the command buffer. Nothing reaches the
+// device until flush_cmds() is called, either directly or by a read.
+void queue_cmd(struct spi_ctx *spi, const uint8_t *data, int n) {
+  if (spi->failed)
+    return;
+  if (spi->buf_len + n > spi->buf_size) {
+    size_t size = spi->buf_size ? spi->buf_size : BUF_SIZE;
+    while (size < spi->buf_len + n)
+      size *= 2;
+    unsigned char *buf = realloc(spi->buf, size);
+    if (buf == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      error(spi);
+      return;
+    }
+    spi->buf = buf;
+    spi->buf_size = size;
+  }
+  memcpy(spi->buf + spi->buf_len, data, n);
+  spi->buf_len += n;
+}
 
-  if (n < 1)
+void flush_cmds(struct spi_ctx *spi) {
+  if (spi->buf_len == 0)
     return;
 
-  // Output only, update data on negative clock edge.
-  cmd[0] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-  cmd[1] = (n - 1) & 0xff;
-  cmd[2] = ((n - 1) >> 8) & 0xff;
-  if (cmdlen != ftdi_write_data(spi->ftdi, cmd, cmdlen)) {
-    fprintf(stderr, "Write error!\n");
-    error(spi, 2);
+  int n = spi->buf_len;
+  int len = ftdi_write_data(spi->ftdi, spi->buf, n);
+  spi->buf_len = 0;
+  if (n != len) {
+    fprintf(stderr, "Write error (rc=%d, expected %d).\n", len, n);
+    error(spi);
+    return;
   }
+  spi->flushes++;
+  spi->flushed_bytes += n;
+}
 
-  int len = ftdi_write_data(spi->ftdi, data, n);
-  if (n != len) {
-    fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", len, n);
-    error(spi, 2);
+// Flush pending commands and collect n bytes of MISO/GPIO data
+void read_data(struct spi_ctx *spi, uint8_t *data, int n) {
+  uint8_t cmd[1] = {SEND_IMMEDIATE};
+  int len = 0, rem = n;
+
+  queue_cmd(spi, cmd, 1);
+  flush_cmds(spi);
+
+  while (rem > 0) {
+    len = spi->failed ? -1 : ftdi_read_data(spi->ftdi, data, rem);
+    if (len < 0) {
+      if (!spi->failed) {
+        fprintf(stderr, "Read error (chunk, rc=%d, expected %d).\n", len,
+                n);
+        error(spi);
+      }
+      memset(data, 0, rem);
+      return;
+    }
+    data += len;
+    rem -= len;
+  }
+}
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+void crc32_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t *data, int n) {
+  pthread_once(&crc32_once, crc32_init);
+
+  crc = ~crc;
+  while (n-- > 0)
+    crc = crc32_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+double elapsed(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void print_usb_stats(struct spi_ctx *spi) {
+  fprintf(stdout, "USB writes: %lu, %.1f bytes/write\n", spi->flushes,
+          spi->flushes ? (double)spi->flushed_bytes / spi->flushes : 0.0);
+}
+
+void send_spi(struct spi_ctx *spi, uint8_t *data, int n) {
+  unsigned char cmd[3];
+
+  while (n > 0) {
+    int len = n > MAX_XFER ? MAX_XFER : n;
+
+    // Output only, update data on negative clock edge.
+    cmd[0] = MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
+    cmd[1] = (len - 1) & 0xff;
+    cmd[2] = ((len - 1) >> 8) & 0xff;
+    queue_cmd(spi, cmd, 3);
+    queue_cmd(spi, data, len);
+
+    data += len;
+    n -= len;
   }
 }
 
 void xfer_spi(struct spi_ctx *spi, uint8_t *data, int n) {
-  unsigned char cmd[3], *p = data;
-  int cmdlen = 3, len = 0, rem = n;
+  unsigned char cmd[3];
 
   if (n < 1)
     return;
@@ -313,31 +475,14 @@ void xfer_spi(struct spi_ctx *spi, uint8_t *data, int n) {
   cmd[0] = MPSSE_DO_READ | MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
   cmd[1] = (n - 1) & 0xff;
   cmd[2] = ((n - 1) >> 8) & 0xff;
-  if (cmdlen != ftdi_write_data(spi->ftdi, cmd, cmdlen)) {
-    fprintf(stderr, "Write error!\n");
-    error(spi, 2);
-  }
+  queue_cmd(spi, cmd, 3);
+  queue_cmd(spi, data, n);
 
-  len = ftdi_write_data(spi->ftdi, data, n);
-  if (n != len) {
-    fprintf(stderr, "Write error (chunk, rc=%d, expected %d).\n", len, n);
-    error(spi, 2);
-  }
-
-  while (rem > 0) {
-    len = ftdi_read_data(spi->ftdi, p, rem);
-    if (len < 0) {
-      fprintf(stderr, "Read error (chunk, rc=%d, expected %d).\n", len, n);
-      error(spi, 2);
-    }
-    p += len;
-    rem -= len;
-  }
+  read_data(spi, data, n);
 }
 
 uint8_t xfer_spi_bits(struct spi_ctx *spi, uint8_t data, int n) {
   unsigned char cmd[3];
-  int cmdlen = 3;
 
   if (n < 1)
     return 0;
@@ -346,23 +491,14 @@ uint8_t xfer_spi_bits(struct spi_ctx *spi, uint8_t data, int n) {
   cmd[0] = MPSSE_DO_READ | MPSSE_DO_WRITE | MPSSE_WRITE_NEG | MPSSE_BITMODE;
   cmd[1] = (n - 1);
   cmd[2] = data;
-  if (cmdlen != ftdi_write_data(spi->ftdi, cmd, cmdlen)) {
-    fprintf(stderr, "Write error!\n");
-    error(spi, 2);
-  }
-
-  cmdlen = ftdi_read_data(spi->ftdi, cmd, 1);
-  if (cmdlen != 1) {
-    fprintf(stderr, "Read error.\n");
-    error(spi, 2);
-  }
+  queue_cmd(spi, cmd, 3);
 
+  read_data(spi, cmd, 1);
   return cmd[0];
 }
 
 void set_gpio(struct spi_ctx *spi, int slavesel_b, int creset_b) {
   unsigned char cmd[3];
-  int cmdlen = 3;
   uint8_t gpio = 0;
 
   if (slavesel_b) {
@@ -378,27 +514,16 @@ void set_gpio(struct spi_ctx *spi, int slavesel_b, int creset_b) {
   cmd[0] = SET_BITS_LOW;
   cmd[1] = (gpio); // Value
   cmd[2] = (0x93); // Direction
-  if (cmdlen != ftdi_write_data(spi->ftdi, cmd, cmdlen)) {
-    fprintf(stderr, "Write error!\n");
-    error(spi, 2);
-  }
+  queue_cmd(spi, cmd, 3);
 }
 
 int get_cdone(struct spi_ctx *spi) {
   unsigned char cmd[1];
-  int cmdlen = 1;
 
   cmd[0] = GET_BITS_LOW;
-  if (cmdlen != ftdi_write_data(spi->ftdi, cmd, cmdlen)) {
-    fprintf(stderr, "Write error!\n");
-    error(spi, 2);
-  }
+  queue_cmd(spi, cmd, 1);
 
-  cmdlen = ftdi_read_data(spi->ftdi, cmd, 1);
-  if (cmdlen != 1) {
-    fprintf(stderr, "Read error.\n");
-    error(spi, 2);
-  }
+  read_data(spi, cmd, 1);
 
   // ADBUS6 (GPIOL2)
   return (cmd[0] & 0x40) != 0;
@@ -450,6 +575,8 @@ void flash_read_id(struct spi_ctx *spi) {
 
   flash_chip_deselect(spi);
 
+  memcpy(spi->flash.jedec_id, data + 1, 3);
+
   if (spi->verbose) {
     fprintf(stdout, "flash ID:");
     for (int i = 1; i < len; i++)
@@ -458,6 +585,91 @@ void flash_read_id(struct spi_ctx *spi) {
   }
 }
 
+// Fill in spi->flash from the SFDP table, falling back to the built-in
+// parameters for the JEDEC ID when the part has no usable table
+void flash_detect(struct spi_ctx *spi) {
+  struct flash_info *info = &spi->flash, fallback;
+  uint8_t id[3], data[5 + 16 * 4] = {FC_RSFDP, 0, 0, 0, 0};
+  uint32_t bfpt_addr;
+  int dwords;
+  bool sfdp = false;
+
+  memcpy(id, info->jedec_id, 3);
+  if (!flash_info_lookup(&fallback, id))
+    flash_info_defaults(&fallback, id);
+
+  flash_chip_select(spi);
+  xfer_spi(spi, data, 5 + 16);
+  flash_chip_deselect(spi);
+
+  if (sfdp_parse_header(data + 5, &bfpt_addr, &dwords)) {
+    if (dwords > 16)
+      dwords = 16;
+    memset(data, 0, sizeof(data));
+    data[0] = FC_RSFDP;
+    data[1] = bfpt_addr >> 16;
+    data[2] = bfpt_addr >> 8;
+    data[3] = bfpt_addr;
+    flash_chip_select(spi);
+    xfer_spi(spi, data, 5 + dwords * 4);
+    flash_chip_deselect(spi);
+
+    memset(info, 0, sizeof(*info));
+    memcpy(info->jedec_id, id, 3);
+    sfdp = sfdp_parse_bfpt(info, data + 5, dwords);
+  }
+
+  if (!sfdp) {
+    *info = fallback;
+  } else {
+    // JESD216 tables before revision A don't carry timings
+    for (int i = 0; i < info->n_erase; i++) {
+      struct flash_erase_type *e = &info->erase[i];
+      if (e->typ_us != 0)
+        continue;
+      e->typ_us = fallback.erase[0].typ_us;
+      e->max_us = fallback.erase[0].max_us;
+      for (int j = 0; j < fallback.n_erase; j++) {
+        if (fallback.erase[j].size == e->size) {
+          e->typ_us = fallback.erase[j].typ_us;
+          e->max_us = fallback.erase[j].max_us;
+        }
+      }
+    }
+    if (info->page_prog_typ_us == 0) {
+      info->page_prog_typ_us = fallback.page_prog_typ_us;
+      info->page_prog_max_us = fallback.page_prog_max_us;
+    }
+    if (info->chip_erase_typ_ms == 0) {
+      info->chip_erase_typ_ms = fallback.chip_erase_typ_ms;
+      info->chip_erase_max_ms = fallback.chip_erase_max_ms;
+    }
+  }
+
+  flash_info_print(info);
+
+  if (info->addr4_cmd) {
+    uint8_t cmd[1] = {FC_EN4B};
+    flash_chip_select(spi);
+    send_spi(spi, cmd, 1);
+    flash_chip_deselect(spi);
+  }
+}
+
+// Write a command byte followed by an address in the width the flash is
+// using, returns the number of bytes written
+int flash_addr(struct spi_ctx *spi, uint8_t *buf, uint8_t cmd, long addr) {
+  int n = 0;
+
+  buf[n++] = cmd;
+  if (spi->flash.addr_bytes == 4)
+    buf[n++] = addr >> 24;
+  buf[n++] = addr >> 16;
+  buf[n++] = addr >> 8;
+  buf[n++] = addr;
+  return n;
+}
+
 void flash_reset(struct spi_ctx *spi) {
   flash_chip_select(spi);
   xfer_spi_bits(spi, 0xFF, 8);
@@ -523,7 +735,6 @@ uint8_t flash_read_status(struct spi_ctx *spi) {
             ((data[1] & (1 << 0)) == 0) ? "Ready" : "Busy");
   }
 
-  usleep(1000);
   return data[1];
 }
 
@@ -547,91 +758,203 @@ void flash_write_enable(struct spi_ctx *spi) {
   }
 }
 
-void flash_bulk_erase(struct spi_ctx *spi) {
-  if (spi->verbose)
-    fprintf(stdout, "bulk erase..\n");
+void flash_erase(struct spi_ctx *spi, uint8_t cmd, long addr) {
+  uint8_t command[5];
+  int len = flash_addr(spi, command, cmd, addr);
+
+  if (spi->verbose) {
+    if (cmd == FC_CE)
+      fprintf(stdout, "bulk erase..\n");
+    else
+      fprintf(stdout, "erase 0x%02X at 0x%06lX..\n", cmd, addr);
+  }
 
-  uint8_t data[1] = {FC_CE};
   flash_chip_select(spi);
-  xfer_spi(spi, data, 1);
+  send_spi(spi, command, cmd == FC_CE ? 1 : len);
   flash_chip_deselect(spi);
 }
 
-void flash_64kB_sector_erase(struct spi_ctx *spi, int addr) {
+void flash_prog(struct spi_ctx *spi, long addr, uint8_t *data, int n) {
   if (spi->verbose)
-    fprintf(stdout, "erase 64kB sector at 0x%06X..\n", addr);
+    fprintf(stdout, "prog 0x%06lX +0x%03X..\n", addr, n);
 
-  uint8_t command[4] = {FC_BE64, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8),
-                        (uint8_t)addr};
+  uint8_t command[5];
+  int len = flash_addr(spi, command, FC_PP, addr);
 
   flash_chip_select(spi);
-  send_spi(spi, command, 4);
+  send_spi(spi, command, len);
+  send_spi(spi, data, n);
   flash_chip_deselect(spi);
+
+  if (spi->verbose)
+    for (int i = 0; i < n; i++)
+      fprintf(stderr, "%02x%c", data[i],
+              i == n - 1 || i % 32 == 31 ? '\n' : ' ');
 }
 
-void flash_prog(struct spi_ctx *spi, int addr, uint8_t *data, int n) {
+static bool copy_sink(void *arg, long offset, const uint8_t *data, int n) {
+  memcpy((uint8_t *)arg + offset, data, n);
+  return true;
+}
+
+void flash_read(struct spi_ctx *spi, long addr, uint8_t *data, long n) {
+  flash_read_stream(spi, addr, n, copy_sink, data);
+}
+
+// Read n bytes starting at addr with a single fast read command and hand
+// them to sink in MAX_XFER sized pieces. The next read burst is queued
+// before the current one is collected, so the FTDI keeps clocking while
+// the sink works on the data.
+bool flash_read_stream(struct spi_ctx *spi, long addr, long n, flash_sink sink,
+                       void *arg) {
   if (spi->verbose)
-    fprintf(stdout, "prog 0x%06X +0x%03X..\n", addr, n);
+    fprintf(stdout, "read 0x%06lX +0x%06lX..\n", addr, n);
 
-  uint8_t command[4] = {FC_PP, (uint8_t)(addr >> 16), (uint8_t)(addr >> 8),
-                        (uint8_t)addr};
+  // Fast read takes one dummy byte after the address
+  uint8_t command[6];
+  int len = flash_addr(spi, command, FC_FR, addr);
+  uint8_t cmd[3];
+  uint8_t *buf = malloc(MAX_XFER);
+  bool ret = true;
 
+  if (buf == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+
+  command[len++] = 0;
   flash_chip_select(spi);
-  send_spi(spi, command, 4);
-  send_spi(spi, data, n);
+  send_spi(spi, command, len);
+
+  // Input only, read on positive edge.
+  cmd[0] = MPSSE_DO_READ;
+  for (long pos = 0; pos < n;) {
+    int len = n - pos > MAX_XFER ? MAX_XFER : n - pos;
+    if (pos == 0) {
+      cmd[1] = (len - 1) & 0xff;
+      cmd[2] = ((len - 1) >> 8) & 0xff;
+      queue_cmd(spi, cmd, 3);
+    }
+    if (pos + len < n) {
+      int next = n - pos - len > MAX_XFER ? MAX_XFER : n - pos - len;
+      cmd[1] = (next - 1) & 0xff;
+      cmd[2] = ((next - 1) >> 8) & 0xff;
+      queue_cmd(spi, cmd, 3);
+    }
+    read_data(spi, buf, len);
+
+    if (ret && !sink(arg, pos, buf, len))
+      ret = false;
+    pos += len;
+    progress_report(&spi->progress, pos, n);
+  }
+
   flash_chip_deselect(spi);
+  flush_cmds(spi);
+  free(buf);
+  return ret && !spi->failed;
+}
 
-  if (spi->verbose)
-    for (int i = 0; i < n; i++)
-      fprintf(stderr, "%02x%c", data[i],
-              i == n - 1 || i % 32 == 31 ? '\n' : ' ');
+// Keep the MPSSE busy for about us microseconds by clocking SCK without
+// transferring data
+void queue_delay(struct spi_ctx *spi, uint32_t us) {
+  long bytes = (long)us * SCK_BYTES_PER_MS / 1000;
+
+  while (bytes > 0) {
+    long len = bytes > MAX_XFER ? MAX_XFER : bytes;
+    uint8_t cmd[3] = {CLK_BYTES, (len - 1) & 0xff, ((len - 1) >> 8) & 0xff};
+    queue_cmd(spi, cmd, 3);
+    bytes -= len;
+  }
 }
 
-void flash_wait(struct spi_ctx *spi) {
+// Sample the busy bit POLL_SAMPLES times in one USB round trip: after
+// lead_us, then every gap_us. The flash keeps shifting out status while
+// chip select stays low, so a single RSR1 command covers all samples.
+// Returns the index of the first ready sample or -1 if still busy.
+int flash_poll(struct spi_ctx *spi, uint32_t lead_us, uint32_t gap_us) {
+  uint8_t status[POLL_SAMPLES];
+  uint8_t rsr[1] = {FC_RSR1};
+  uint8_t cmd[3] = {MPSSE_DO_READ, 0, 0};
+
+  // Chip select is high here so the clocks are ignored by the flash
+  queue_delay(spi, lead_us);
+
+  flash_chip_select(spi);
+  send_spi(spi, rsr, 1);
+  for (int i = 0; i < POLL_SAMPLES; i++) {
+    if (i > 0)
+      queue_delay(spi, gap_us);
+    queue_cmd(spi, cmd, 3);
+  }
+  flash_chip_deselect(spi);
+
+  read_data(spi, status, POLL_SAMPLES);
+
+  for (int i = 0; i < POLL_SAMPLES; i++)
+    if ((status[i] & 0x01) == 0)
+      return i;
+  return -1;
+}
+
+// Wait for a program or erase that typically takes typ_us to finish.
+// Sampling starts at 3/4 of the typical time and is spread around the
+// expected completion, backing off while the flash stays busy. Gives up
+// once max_us, the worst case for the operation, has passed twice over.
+bool flash_wait(struct spi_ctx *spi, uint32_t typ_us, uint32_t max_us) {
+  struct timespec start;
+  double timeout = 2.0 * max_us / 1e6 + 0.1;
+  uint32_t lead = typ_us / 4 * 3, gap = typ_us / 4 / POLL_SAMPLES;
+
   if (spi->verbose)
     fprintf(stderr, "waiting..");
 
-  int count = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Long operations aren't worth keeping the MPSSE busy for
+  if (lead > POLL_SLEEP_US) {
+    flush_cmds(spi);
+    usleep(lead);
+    lead = 0;
+  }
+
   while (1) {
-    uint8_t data[2] = {FC_RSR1};
+    if (gap < POLL_MIN_GAP_US)
+      gap = POLL_MIN_GAP_US;
+    if (gap > POLL_MAX_GAP_US)
+      gap = POLL_MAX_GAP_US;
 
-    flash_chip_select(spi);
-    xfer_spi(spi, data, 2);
-    flash_chip_deselect(spi);
+    int ready = flash_poll(spi, lead, gap);
+    if (spi->failed)
+      return false;
+    if (ready >= 0) {
+      if (spi->verbose)
+        fprintf(stderr, "R%d\n", ready);
+      return true;
+    }
 
-    if ((data[1] & 0x01) == 0) {
-      if (count < 2) {
-        count++;
-        if (spi->verbose) {
-          fprintf(stderr, "r");
-          fflush(stderr);
-        }
-      } else {
-        if (spi->verbose) {
-          fprintf(stderr, "R");
-          fflush(stderr);
-        }
-        break;
-      }
-    } else {
-      if (spi->verbose) {
-        fprintf(stderr, ".");
-        fflush(stderr);
-      }
-      count = 0;
+    if (spi->verbose) {
+      fprintf(stderr, ".");
+      fflush(stderr);
+    }
+    if (elapsed(&start) > timeout) {
+      fprintf(stderr, "Timed out waiting for flash!\n");
+      return false;
     }
 
-    usleep(1000);
+    lead = 0;
+    gap *= 2;
+    if (typ_us > POLL_SLEEP_US)
+      usleep(typ_us / 16 > 100000 ? 100000 : typ_us / 16);
   }
-
-  if (spi->verbose)
-    fprintf(stderr, "\n");
 }
 
-bool spi_erase_flash(struct spi_ctx *spi) {
+// Hold the FPGA in reset and wake the flash up
+void flash_enter(struct spi_ctx *spi) {
   fprintf(stdout, "Resetting...\n");
 
   flash_chip_deselect(spi);
+  flush_cmds(spi);
   usleep(250000);
 
   if (spi->verbose) {
@@ -642,111 +965,605 @@ bool spi_erase_flash(struct spi_ctx *spi) {
   flash_power_up(spi);
 
   flash_read_id(spi);
+  flash_detect(spi);
+}
 
-  flash_write_enable(spi);
-  flash_bulk_erase(spi);
-  flash_wait(spi);
-
-  // ---------------------------------------------------------
-  // Reset
-  // ---------------------------------------------------------
+// Put the flash back to sleep and release the FPGA from reset
+void flash_leave(struct spi_ctx *spi) {
+  // The FPGA boots with 3 byte addresses
+  if (spi->flash.addr4_cmd) {
+    uint8_t cmd[1] = {FC_EX4B};
+    flash_chip_select(spi);
+    send_spi(spi, cmd, 1);
+    flash_chip_deselect(spi);
+  }
 
   flash_power_down(spi);
 
   set_gpio(spi, 1, 1);
+  flush_cmds(spi);
   usleep(250000);
 
   if (spi->verbose) {
     fprintf(stdout, "cdone: %s\n", get_cdone(spi) ? "high" : "low");
   }
+}
+
+struct dump_state {
+  FILE *f;
+  uint32_t crc;
+};
+
+static bool dump_sink(void *arg, long offset, const uint8_t *data, int n) {
+  struct dump_state *dump = arg;
 
+  dump->crc = crc32_update(dump->crc, data, n);
+  if (n != (int)fwrite(data, 1, n, dump->f)) {
+    fprintf(stderr, "Failed to write flash dump!\n");
+    return false;
+  }
   return true;
 }
 
-bool spi_write_bin(struct spi_ctx *spi, char *filename) {
-  int rw_offset = 0;
+struct verify_state {
+  const uint8_t *image;
+  long first_mismatch;
+  long mismatches;
+};
+
+static bool verify_sink(void *arg, long offset, const uint8_t *data, int n) {
+  struct verify_state *verify = arg;
+  const uint8_t *img = verify->image + offset;
+
+  if (memcmp(img, data, n) == 0)
+    return true;
+
+  for (int i = 0; i < n; i++) {
+    if (img[i] != data[i]) {
+      if (verify->mismatches++ == 0)
+        verify->first_mismatch = offset + i;
+    }
+  }
+  return true;
+}
+
+bool spi_read_flash(struct spi_ctx *spi, char *filename, long size) {
+  struct dump_state dump = {NULL, 0};
+  struct timespec start;
+
+  dump.f = fopen(filename, "wb");
+  if (dump.f == NULL) {
+    fprintf(stderr, "Can't open '%s' for writing!\n", filename);
+    return false;
+  }
+
+  flash_enter(spi);
+  if (size <= 0 || size > spi->flash.size)
+    size = spi->flash.size;
+
+  fprintf(stdout, "Reading...\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool ret = flash_read_stream(spi, 0, size, dump_sink, &dump);
+  double t = elapsed(&start);
+
+  flash_leave(spi);
+
+  if (fclose(dump.f) != 0)
+    ret = false;
+  if (ret)
+    fprintf(stdout, "Read %ld bytes in %.2fs (%.2f MB/s), CRC32 %08X\n", size,
+            t, size / t / 1e6, dump.crc);
+  return ret;
+}
+
+// Read the first size bytes of flash, all of it for 0, into a buffer
+// the caller frees
+bool spi_read_flash_buf(struct spi_ctx *spi, long size, uint8_t **data,
+                        long *len) {
+  uint8_t *buf;
+
+  *data = NULL;
+  *len = 0;
+  flash_enter(spi);
+  if (size <= 0 || size > spi->flash.size)
+    size = spi->flash.size;
+
+  if ((buf = malloc(size > 0 ? size : 1)) == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    flash_leave(spi);
+    return false;
+  }
+
+  bool ret = flash_read_stream(spi, 0, size, copy_sink, buf);
+  flash_leave(spi);
 
-  FILE *f = NULL;
+  if (!ret) {
+    free(buf);
+    return false;
+  }
+  *data = buf;
+  *len = size;
+  return true;
+}
+
+bool spi_verify_bin(struct spi_ctx *spi, char *filename) {
+  struct verify_state verify = {NULL, -1, 0};
+  struct timespec start;
+  uint8_t *image = NULL;
   long file_size = -1;
 
-  f = fopen(filename, "rb");
+  if (!read_file(filename, &image, &file_size))
+    return false;
+  verify.image = image;
+
+  flash_enter(spi);
+
+  if (file_size > spi->flash.size) {
+    fprintf(stderr, "Image is larger than the %ld bytes of flash!\n",
+            spi->flash.size);
+    flash_leave(spi);
+    free(image);
+    return false;
+  }
+
+  fprintf(stdout, "Verifying...\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  bool ret = flash_read_stream(spi, 0, file_size, verify_sink, &verify);
+  double t = elapsed(&start);
+
+  flash_leave(spi);
+  free(image);
+
+  if (!ret)
+    return false;
+
+  if (verify.mismatches > 0) {
+    fprintf(stderr, "Verify failed: %ld bytes differ, first at 0x%06lX\n",
+            verify.mismatches, verify.first_mismatch);
+    return false;
+  }
+  fprintf(stdout, "Verified %ld bytes in %.2fs (%.2f MB/s)\n", file_size, t,
+          file_size / t / 1e6);
+  return true;
+}
+
+bool spi_erase_flash(struct spi_ctx *spi) {
+  struct erase_plan plan;
+
+  flash_enter(spi);
+
+  if (!plan_init(&plan, &spi->flash)) {
+    flash_leave(spi);
+    return false;
+  }
+  memset(plan.state, SECTOR_ERASE, plan.sectors);
+  plan_erase(spi, &plan);
+  bool ok = run_plan(spi, &plan);
+  plan_free(&plan);
+
+  flash_leave(spi);
+
+  return ok && !spi->failed;
+}
+
+bool read_file(const char *filename, uint8_t **data, long *size) {
+  FILE *f = fopen(filename, "rb");
+  long file_size = -1;
 
   if (f == NULL) {
-    fprintf(stderr, "Can't open '%s' for reading: ", filename);
+    fprintf(stderr, "Can't open '%s' for reading!\n", filename);
     return false;
   }
 
-  if (fseek(f, 0L, SEEK_END) != -1) {
-    file_size = ftell(f);
-    if (file_size == -1) {
-      fprintf(stderr, "%s: ftell: ", filename);
-      return false;
+  if (fseek(f, 0L, SEEK_END) == -1 || (file_size = ftell(f)) == -1 ||
+      fseek(f, 0L, SEEK_SET) == -1) {
+    fprintf(stderr, "%s: can't determine file size!\n", filename);
+    fclose(f);
+    return false;
+  }
+
+  *data = malloc(file_size > 0 ? file_size : 1);
+  if (*data == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    fclose(f);
+    return false;
+  }
+
+  if (file_size != (long)fread(*data, 1, file_size, f)) {
+    fprintf(stderr, "%s: short read!\n", filename);
+    free(*data);
+    fclose(f);
+    return false;
+  }
+
+  fclose(f);
+  *size = file_size;
+  return true;
+}
+
+// Decide what each 4kB sector needs by comparing the image with the current
+// flash contents. A sector that only needs bits cleared can be programmed in
+// place, anything else has to be erased first.
+void diff_sectors(struct spi_ctx *spi, int sector_size, long offset,
+                  uint8_t *image, long size, uint8_t *current,
+                  uint8_t *state) {
+  long begin_addr = offset - offset % sector_size;
+  long end_addr = offset + size;
+
+  for (long addr = begin_addr; addr < end_addr; addr += sector_size) {
+    long lo = addr < offset ? offset : addr;
+    long hi = addr + sector_size > end_addr ? end_addr : addr + sector_size;
+    uint8_t *img = image + (lo - offset), *cur = current + (lo - offset);
+    uint8_t st = SECTOR_CLEAN;
+
+    if (memcmp(img, cur, hi - lo) != 0) {
+      st = SECTOR_PROGRAM;
+      for (int i = 0; i < hi - lo; i++) {
+        if ((img[i] & cur[i]) != img[i]) {
+          st = SECTOR_ERASE;
+          break;
+        }
+      }
     }
-    if (fseek(f, 0L, SEEK_SET) == -1) {
-      fprintf(stderr, "%s: fseek: ", filename);
+    state[(addr - begin_addr) / sector_size] = st;
+
+    if (spi->verbose)
+      fprintf(stdout, "sector 0x%06lX: %s\n", addr,
+              st == SECTOR_CLEAN     ? "unchanged"
+              : st == SECTOR_PROGRAM ? "program"
+                                     : "erase+program");
+  }
+}
+
+// True when the data is all 0xFF, which is what an erased page reads as
+bool page_erased(const uint8_t *data, int n) {
+  while (n >= (int)sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    if (word != UINT64_MAX)
+      return false;
+    data += sizeof(word);
+    n -= sizeof(word);
+  }
+  while (n-- > 0)
+    if (*data++ != 0xFF)
       return false;
+  return true;
+}
+
+// Whether a page has to be programmed once its sector is in the given
+// state. Pages that are all 0xFF are left alone after an erase, so a
+// sector that is blank in the image costs no programming time.
+bool page_needs_prog(uint8_t state, const uint8_t *image,
+                     const uint8_t *current, int n) {
+  switch (state) {
+  case SECTOR_ERASE:
+    return !page_erased(image, n);
+  case SECTOR_PROGRAM:
+    return memcmp(image, current, n) != 0;
+  default:
+    return false;
+  }
+}
+
+bool plan_init(struct erase_plan *plan, const struct flash_info *flash) {
+  memset(plan, 0, sizeof(*plan));
+  plan->flash = flash;
+  plan->sector_size = flash->erase[flash->n_erase - 1].size;
+  plan->sectors = flash->size / plan->sector_size;
+  plan->state = calloc(plan->sectors, sizeof(*plan->state));
+  plan->penalty = calloc(plan->sectors, sizeof(*plan->penalty));
+  plan->ops = calloc(plan->sectors + 1, sizeof(*plan->ops));
+  if (plan->state == NULL || plan->penalty == NULL || plan->ops == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    plan_free(plan);
+    return false;
+  }
+  return true;
+}
+
+void plan_free(struct erase_plan *plan) {
+  free(plan->state);
+  free(plan->penalty);
+  free(plan->ops);
+  memset(plan, 0, sizeof(*plan));
+}
+
+// Cheapest way to get every SECTOR_ERASE sector inside the flash->erase[k]
+// sized region at addr erased: either one erase of that size, or the best
+// plan for each of its smaller subregions. With emit set the chosen erase
+// commands are added to the plan.
+static long long plan_region(struct erase_plan *plan, int k, long addr,
+                             bool emit) {
+  const struct flash_erase_type *kind = &plan->flash->erase[k];
+  int first = addr / plan->sector_size, n = kind->size / plan->sector_size;
+  long long whole = kind->typ_us + ERASE_OVERHEAD_US, split = PLAN_INF;
+  bool needed = false;
+
+  for (int i = first; i < first + n; i++) {
+    if (plan->state[i] == SECTOR_ERASE)
+      needed = true;
+    if (plan->penalty[i] < 0)
+      whole = PLAN_INF;
+    else if (whole < PLAN_INF)
+      whole += plan->penalty[i];
+  }
+
+  if (!needed)
+    return 0;
+
+  if (k + 1 < plan->flash->n_erase) {
+    int sub = plan->flash->erase[k + 1].size;
+    split = 0;
+    for (long a = addr; a < addr + kind->size; a += sub)
+      split += plan_region(plan, k + 1, a, false);
+  }
+
+  if (emit) {
+    if (whole <= split) {
+      struct erase_op op = {kind->cmd, addr, kind->size};
+      plan->ops[plan->n_ops++] = op;
+      memset(plan->state + first, SECTOR_ERASE, n);
+    } else {
+      for (long a = addr; a < addr + kind->size;
+           a += plan->flash->erase[k + 1].size)
+        plan_region(plan, k + 1, a, true);
     }
   }
 
-  fprintf(stdout, "Resetting...\n");
+  return whole < split ? whole : split;
+}
 
-  flash_chip_deselect(spi);
-  usleep(250000);
+// Pick the cheapest mix of chip and block/sector erases the flash offers
+// that covers every sector marked SECTOR_ERASE, counting the time to
+// reprogram sectors that get erased along the way.
+void plan_erase(struct spi_ctx *spi, struct erase_plan *plan) {
+  const struct flash_info *flash = plan->flash;
+  long size = flash->erase[0].size;
+  long long chip = flash->chip_erase_typ_ms * 1000LL + ERASE_OVERHEAD_US;
+  long long total = 0;
+
+  for (int i = 0; i < plan->sectors; i++) {
+    if (plan->penalty[i] < 0)
+      chip = PLAN_INF;
+    else if (chip < PLAN_INF)
+      chip += plan->penalty[i];
+  }
 
-  if (spi->verbose) {
-    fprintf(stdout, "cdone: %s\n", get_cdone(spi) ? "high" : "low");
+  plan->n_ops = 0;
+  for (long addr = 0; addr < flash->size; addr += size)
+    total += plan_region(plan, 0, addr, false);
+
+  if (chip < total) {
+    struct erase_op op = {FC_CE, 0, flash->size};
+    plan->ops[plan->n_ops++] = op;
+    memset(plan->state, SECTOR_ERASE, plan->sectors);
+    plan->est_us = chip;
+  } else {
+    for (long addr = 0; addr < flash->size; addr += size)
+      plan_region(plan, 0, addr, true);
+    plan->est_us = total;
   }
 
-  flash_reset(spi);
-  flash_power_up(spi);
+  if (plan->n_ops > 0) {
+    fprintf(stdout, "Erase plan:");
+    if (plan->ops[0].cmd == FC_CE)
+      fprintf(stdout, " chip");
+    for (int k = 0; k < flash->n_erase; k++) {
+      int count = 0;
+      for (int i = 0; i < plan->n_ops; i++)
+        count += plan->ops[i].cmd == flash->erase[k].cmd;
+      if (count > 0)
+        fprintf(stdout, " %d x %dkB", count, flash->erase[k].size / 1024);
+    }
+    fprintf(stdout, " (~%.2fs)\n", plan->est_us / 1e6);
+  }
+}
 
-  flash_read_id(spi);
+bool run_plan(struct spi_ctx *spi, struct erase_plan *plan) {
+  for (int i = 0; i < plan->n_ops; i++) {
+    uint32_t typ_us = plan->flash->chip_erase_typ_ms * 1000;
+    uint32_t max_us = plan->flash->chip_erase_max_ms * 1000;
 
-  int begin_addr = rw_offset & ~0xffff;
-  int end_addr = (rw_offset + file_size + 0xffff) & ~0xffff;
+    for (int k = 0; k < plan->flash->n_erase; k++) {
+      if (plan->flash->erase[k].cmd == plan->ops[i].cmd) {
+        typ_us = plan->flash->erase[k].typ_us;
+        max_us = plan->flash->erase[k].max_us;
+      }
+    }
 
-  for (int addr = begin_addr; addr < end_addr; addr += 0x10000) {
     flash_write_enable(spi);
-    flash_64kB_sector_erase(spi, addr);
+    flash_erase(spi, plan->ops[i].cmd, plan->ops[i].addr);
     if (spi->verbose) {
-      fprintf(stderr, "Status after block erase:\n");
+      fprintf(stderr, "Status after erase:\n");
       flash_read_status(spi);
     }
-    flash_wait(spi);
+    if (!flash_wait(spi, typ_us, max_us))
+      return false;
   }
+  return true;
+}
+
+bool spi_write_bin(struct spi_ctx *spi, char *filename) {
+  long rw_offset = 0;
+
+  uint8_t *image = NULL, *current = NULL;
+  long file_size = -1;
+  struct erase_plan plan;
+
+  if (!read_file(filename, &image, &file_size))
+    return false;
+
+  if (spi->incremental) {
+    current = malloc(file_size > 0 ? file_size : 1);
+    if (current == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      free(image);
+      return false;
+    }
+  }
+
+  flash_enter(spi);
+
+  if (rw_offset + file_size > spi->flash.size) {
+    fprintf(stderr, "Image doesn't fit in %ld bytes of flash!\n",
+            spi->flash.size);
+    flash_leave(spi);
+    free(image);
+    free(current);
+    return false;
+  }
+
+  if (!plan_init(&plan, &spi->flash)) {
+    flash_leave(spi);
+    free(image);
+    free(current);
+    return false;
+  }
+
+  int sector_size = plan.sector_size, page_size = spi->flash.page_size;
+  int begin_sector = rw_offset / sector_size;
+  int end_sector = (rw_offset + file_size + sector_size - 1) / sector_size;
+
+  // Sectors outside the image keep their contents
+  for (int i = 0; i < plan.sectors; i++) {
+    plan.state[i] = SECTOR_CLEAN;
+    plan.penalty[i] = -1;
+  }
+  memset(plan.state + begin_sector, SECTOR_ERASE, end_sector - begin_sector);
+
+  if (spi->incremental) {
+    fprintf(stdout, "Comparing...\n");
+    flash_read(spi, rw_offset, current, file_size);
+    diff_sectors(spi, sector_size, rw_offset, image, file_size, current,
+                 plan.state + begin_sector);
+
+    int count[3] = {0, 0, 0};
+    for (int i = begin_sector; i < end_sector; i++)
+      count[plan.state[i]]++;
+    fprintf(stdout,
+            "Sectors: %d unchanged, %d to program, %d to erase and program\n",
+            count[SECTOR_CLEAN], count[SECTOR_PROGRAM], count[SECTOR_ERASE]);
+  }
+
+  // Erasing a sector that doesn't need it costs the pages it then has to
+  // have reprogrammed
+  for (int i = begin_sector; i < end_sector; i++) {
+    long lo = (long)i * sector_size - rw_offset, hi = lo + sector_size;
+    int pages = 0;
+
+    if (lo < 0)
+      lo = 0;
+    if (hi > file_size)
+      hi = file_size;
+    for (long addr = lo; addr < hi; addr += page_size) {
+      int n = hi - addr > page_size ? page_size : hi - addr;
+      pages += page_needs_prog(SECTOR_ERASE, image + addr, NULL, n);
+      if (current)
+        pages -= page_needs_prog(plan.state[i], image + addr, current + addr,
+                                 n);
+    }
+    plan.penalty[i] = pages * spi->flash.page_prog_typ_us;
+  }
+
+  plan_erase(spi, &plan);
+  bool ok = run_plan(spi, &plan);
+
+  int programmed = 0, skipped = 0;
+  if (ok)
+    fprintf(stdout, "Programming...");
+  for (long rc, addr = 0; ok && addr < file_size; addr += rc) {
+    int left = page_size - (rw_offset + addr) % page_size;
+    rc = file_size - addr > left ? left : file_size - addr;
+
+    uint8_t st = plan.state[(rw_offset + addr) / sector_size];
+    if (!page_needs_prog(st, image + addr, current ? current + addr : NULL,
+                         rc)) {
+      skipped++;
+      continue;
+    }
+    programmed++;
 
-  fprintf(stdout, "Programming...");
-  for (int rc, addr = 0; true; addr += rc) {
-    uint8_t buffer[256];
-    int page_size = 256 - (rw_offset + addr) % 256;
-    rc = fread(buffer, 1, page_size, f);
-    if (rc <= 0)
-      break;
     flash_write_enable(spi);
-    flash_prog(spi, rw_offset + addr, buffer, rc);
-    flash_wait(spi);
+    flash_prog(spi, rw_offset + addr, image + addr, rc);
+    ok = flash_wait(spi, spi->flash.page_prog_typ_us,
+                    spi->flash.page_prog_max_us);
+    progress_report(&spi->progress, addr + rc, file_size);
   }
 
-  fprintf(stdout, "Done.\n");
+  if (ok) {
+    fprintf(stdout, "Done.\n");
+    fprintf(stdout, "Pages: %d programmed, %d skipped\n", programmed,
+            skipped);
+  }
+  print_usb_stats(spi);
+
+  flash_leave(spi);
+  if (ok)
+    fprintf(stdout, "Done.\n");
+
+  plan_free(&plan);
+  free(image);
+  free(current);
+  return ok && !spi->failed;
+}
+
+// Configure the iCE40 CRAM directly in SPI slave mode, leaving the flash
+// untouched. The FPGA samples SS on the rising edge of CRESET and ends up
+// in slave mode if SS is low at that point.
+bool spi_load_ram(struct spi_ctx *spi, char *filename) {
+  uint8_t *image = NULL;
+  long file_size = -1;
+  struct timespec start;
 
-  // seek to the beginning for second pass
-  fseek(f, 0, SEEK_SET);
+  if (!read_file(filename, &image, &file_size))
+    return false;
 
-  // ---------------------------------------------------------
-  // Reset
-  // ---------------------------------------------------------
+  fprintf(stdout, "Resetting...\n");
 
+  // SS is shared with the flash, keep it from seeing the bitstream
+  flash_chip_deselect(spi);
   flash_power_down(spi);
 
+  // Hold SS low while releasing CRESET, then give the FPGA time to clear
+  // its configuration memory
+  set_gpio(spi, 0, 0);
+  flush_cmds(spi);
+  usleep(100);
+  set_gpio(spi, 0, 1);
+  flush_cmds(spi);
+  usleep(2000);
+
+  if (get_cdone(spi)) {
+    fprintf(stderr, "CDONE still high after reset!\n");
+    free(image);
+    return false;
+  }
+
+  fprintf(stdout, "Loading...\n");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long pos = 0; pos < file_size; pos += MAX_XFER) {
+    long len = file_size - pos > MAX_XFER ? MAX_XFER : file_size - pos;
+    send_spi(spi, image + pos, len);
+    flush_cmds(spi);
+    progress_report(&spi->progress, pos + len, file_size);
+  }
+  free(image);
+
+  // Deselect and clock out at least 49 more bits to start the FPGA
+  uint8_t cmd[3] = {CLK_BYTES, 7, 0};
   set_gpio(spi, 1, 1);
-  usleep(250000);
+  queue_cmd(spi, cmd, 3);
 
-  if (spi->verbose) {
-    fprintf(stdout, "cdone: %s\n", get_cdone(spi) ? "high" : "low");
+  bool done = get_cdone(spi);
+  double t = elapsed(&start);
+  print_usb_stats(spi);
+
+  if (!done || spi->failed) {
+    fprintf(stderr, "CDONE didn't go high, configuration failed!\n");
+    return false;
   }
-  fprintf(stdout, "Done.\n");
 
-  if (f != NULL && f != stdin && f != stdout)
-    fclose(f);
+  fprintf(stdout, "Loaded %ld bytes in %.2fs\n", file_size, t);
   return true;
 }
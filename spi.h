@@ -10,10 +10,30 @@ extern "C" {
 #include <string.h>
 #include <unistd.h>
 
+#include "flash_info.h"
+#include "progress.h"
+
 struct spi_ctx {
   struct ftdi_context *ftdi;
   bool active;
+  bool failed; // a USB transfer failed, nothing reaches the device anymore
   bool verbose;
+  bool incremental; // only rewrite sectors that differ from the image
+
+  // geometry and timings of the attached flash, see flash_enter()
+  struct flash_info flash;
+
+  // pending MPSSE commands, written out in a single USB transfer
+  unsigned char *buf;
+  size_t buf_len;
+  size_t buf_size;
+
+  // USB transfer statistics
+  unsigned long flushes;
+  unsigned long long flushed_bytes;
+
+  // reports how far flash reads, programming and RAM loads are along
+  struct progress progress;
 };
 
 struct spi_ctx *spi_new();
@@ -21,6 +41,11 @@ void spi_shutdown(struct spi_ctx *spi);
 bool spi_initialize(struct spi_ctx *spi);
 bool spi_erase_flash(struct spi_ctx *spi);
 bool spi_write_bin(struct spi_ctx *spi, char *file);
+bool spi_verify_bin(struct spi_ctx *spi, char *file);
+bool spi_read_flash(struct spi_ctx *spi, char *file, long size);
+bool spi_read_flash_buf(struct spi_ctx *spi, long size, uint8_t **data,
+                        long *len);
+bool spi_load_ram(struct spi_ctx *spi, char *file);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,1008 @@
+#include "svf.h"
+#include "image.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define SVF_WORDS 64   // most words in one statement
+#define CHECK_MAX 1024 // deferred TDO compares kept before checking them
+#define PRINT_BITS 256 // longest vectors printed on a mismatch
+#define SVF_MAX_BITS (1u << 28) // longest scan, header and trailer included
+
+// Scan patterns SVF keeps between statements, in the order of the commands
+// that set them
+enum svf_reg { HDR, HIR, SDR, SIR, TDR, TIR, SVF_REGS };
+
+enum xsvf_command {
+  XCOMPLETE = 0x00,
+  XTDOMASK = 0x01,
+  XSIR = 0x02,
+  XSDR = 0x03,
+  XRUNTEST = 0x04,
+  XREPEAT = 0x07,
+  XSDRSIZE = 0x08,
+  XSDRTDO = 0x09,
+  XSTATE = 0x12,
+  XENDIR = 0x13,
+  XENDDR = 0x14,
+  XSIR2 = 0x15,
+  XCOMMENT = 0x16,
+  XWAIT = 0x17
+};
+
+struct svf_scan {
+  unsigned int bits;
+  uint8_t *tdi;
+  uint8_t *tdo;
+  uint8_t *mask;
+  uint8_t *smask;
+  bool check; // TDO was given by the last statement
+};
+
+// A deferred capture, compared once its TDO has been collected
+struct svf_check {
+  size_t pos; // line, or command offset in XSVF files
+  unsigned int bits;
+  uint8_t *data; // captured TDO followed by the expected value and mask
+};
+
+// A word of a statement, values in parentheses are one word without them
+struct svf_word {
+  const char *text;
+  size_t len;
+  bool value;
+};
+
+struct svf_ctx {
+  struct jtag_ctx *jtag;
+  const char *file;
+  bool xsvf;
+
+  const char *data;
+  const char *pos;
+  const char *end;
+  size_t line;      // where pos is
+  size_t statement; // line or command offset being run
+
+  enum jtag_fsm_state state;
+  enum jtag_fsm_state end_ir;
+  enum jtag_fsm_state end_dr;
+  enum jtag_fsm_state run_state;
+  enum jtag_fsm_state run_end;
+  double freq; // FREQUENCY without a value goes back to this
+
+  struct svf_scan scan[SVF_REGS];
+
+  // whole scans, header and trailer included
+  uint8_t *tdi;
+  size_t tdi_size;
+
+  // XSVF keeps the expected TDO and its mask between commands
+  unsigned int sdr_bits;
+  uint8_t *expected;
+  uint8_t *mask;
+  uint8_t *tdo;
+  size_t tdo_size;
+
+  struct svf_check *checks;
+  size_t n_checks;
+  size_t checks_size;
+};
+
+// SVF names of the TAP states, in jtag_fsm_state order
+static const char *const state_names[] = {
+    "RESET",    "IDLE",     "DRSELECT", "DRCAPTURE", "DRSHIFT",  "DREXIT1",
+    "DRPAUSE",  "DREXIT2",  "DRUPDATE", "IRSELECT",  "IRCAPTURE", "IRSHIFT",
+    "IREXIT1",  "IRPAUSE",  "IREXIT2",  "IRUPDATE"};
+
+static void svf_init(struct svf_ctx *ctx, struct jtag_ctx *jtag,
+                     const char *file, const struct image *img);
+static void svf_free(struct svf_ctx *ctx);
+static uint8_t *grow(uint8_t **buf, size_t *size, size_t n);
+static size_t bit_bytes(size_t bits);
+static void copy_bits(uint8_t *dst, size_t offset, const uint8_t *src,
+                      unsigned int bits);
+static void print_vector(const char *label, const uint8_t *data,
+                         unsigned int bits);
+static bool is_stable(enum jtag_fsm_state state);
+static bool svf_reset(struct svf_ctx *ctx);
+static bool svf_goto(struct svf_ctx *ctx, enum jtag_fsm_state state);
+static bool svf_wait(struct svf_ctx *ctx, unsigned long clocks, double secs);
+static uint8_t *svf_add_check(struct svf_ctx *ctx, unsigned int bits);
+static bool svf_compare(struct svf_ctx *ctx);
+static bool svf_capture(struct svf_ctx *ctx, unsigned int bits,
+                        const uint8_t *tdi, const uint8_t *expected,
+                        const uint8_t *mask);
+static bool next_statement(struct svf_ctx *ctx, struct svf_word *words,
+                           size_t *n, bool *eof);
+static bool word_is(const struct svf_word *w, const char *keyword);
+static bool parse_number(struct svf_ctx *ctx, const struct svf_word *w,
+                         double *value);
+static bool parse_state(const struct svf_word *w,
+                        enum jtag_fsm_state *state);
+static bool parse_stable(struct svf_ctx *ctx, const struct svf_word *w,
+                         enum jtag_fsm_state *state);
+static bool parse_hex(struct svf_ctx *ctx, const struct svf_word *w,
+                      uint8_t *dst, unsigned int bits);
+static bool svf_run(struct svf_ctx *ctx, const struct svf_word *w, size_t n);
+static bool svf_scan(struct svf_ctx *ctx, enum svf_reg reg,
+                     const struct svf_word *w, size_t n);
+static bool svf_shift(struct svf_ctx *ctx, bool ir);
+static bool svf_runtest(struct svf_ctx *ctx, const struct svf_word *w,
+                        size_t n);
+static bool svf_state(struct svf_ctx *ctx, const struct svf_word *w,
+                      size_t n);
+static bool svf_frequency(struct svf_ctx *ctx, const struct svf_word *w,
+                          size_t n);
+static const uint8_t *xsvf_take(struct svf_ctx *ctx, size_t n);
+static unsigned long xsvf_number(const uint8_t *data, size_t n);
+static void xsvf_vector(uint8_t *dst, const uint8_t *src, unsigned int bits);
+static bool xsvf_sdr_size(struct svf_ctx *ctx, unsigned int bits);
+static bool xsvf_shift(struct svf_ctx *ctx, bool ir, unsigned int bits,
+                       const uint8_t *tdi, bool check, unsigned int repeat,
+                       unsigned long usecs);
+static bool xsvf_run(struct svf_ctx *ctx, bool *complete,
+                     unsigned int *repeat, unsigned long *usecs);
+
+void svf_init(struct svf_ctx *ctx, struct jtag_ctx *jtag, const char *file,
+              const struct image *img) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->jtag = jtag;
+  ctx->file = file;
+  ctx->data = (const char *)img->data;
+  ctx->pos = ctx->data;
+  ctx->end = ctx->data + img->size;
+  ctx->line = 1;
+  ctx->state = TEST_LOGIC_RESET;
+  ctx->end_ir = RUN_TEST_IDLE;
+  ctx->end_dr = RUN_TEST_IDLE;
+  ctx->run_state = RUN_TEST_IDLE;
+  ctx->run_end = RUN_TEST_IDLE;
+  ctx->freq = jtag->freq;
+}
+
+void svf_free(struct svf_ctx *ctx) {
+  for (int i = 0; i < SVF_REGS; i++)
+    free(ctx->scan[i].tdi);
+  for (size_t i = 0; i < ctx->n_checks; i++)
+    free(ctx->checks[i].data);
+  free(ctx->checks);
+  free(ctx->tdi);
+  free(ctx->expected);
+  free(ctx->tdo);
+}
+
+uint8_t *grow(uint8_t **buf, size_t *size, size_t n) {
+  if (n > *size) {
+    uint8_t *p = realloc(*buf, n);
+    if (p == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      return NULL;
+    }
+    *buf = p;
+    *size = n;
+  }
+  return *buf;
+}
+
+size_t bit_bytes(size_t bits) { return (bits + 7) / 8; }
+
+// OR bits from src into dst starting at bit offset
+void copy_bits(uint8_t *dst, size_t offset, const uint8_t *src,
+               unsigned int bits) {
+  if (offset % 8 == 0) {
+    for (size_t i = 0; i < bits / 8; i++)
+      dst[offset / 8 + i] |= src[i];
+    if (bits % 8 != 0)
+      dst[(offset + bits) / 8] |= src[bits / 8] & ((1 << (bits % 8)) - 1);
+    return;
+  }
+  for (unsigned int i = 0; i < bits; i++) {
+    if ((src[i / 8] >> (i % 8)) & 0x01)
+      dst[(offset + i) / 8] |= 1 << ((offset + i) % 8);
+  }
+}
+
+void print_vector(const char *label, const uint8_t *data, unsigned int bits) {
+  fprintf(stderr, "%s", label);
+  for (int i = (int)bit_bytes(bits) - 1; i >= 0; i--)
+    fprintf(stderr, "%02X", data[i]);
+  fprintf(stderr, "\n");
+}
+
+bool is_stable(enum jtag_fsm_state state) {
+  return state == TEST_LOGIC_RESET || state == RUN_TEST_IDLE ||
+         state == PAUSE_DR || state == PAUSE_IR;
+}
+
+// Five TMS ones reach RESET from anywhere
+bool svf_reset(struct svf_ctx *ctx) {
+  ctx->state = TEST_LOGIC_RESET;
+  return jtag_navigate_to_state(ctx->jtag, CAPTURE_DR, TEST_LOGIC_RESET);
+}
+
+bool svf_goto(struct svf_ctx *ctx, enum jtag_fsm_state state) {
+  if (!jtag_navigate_to_state(ctx->jtag, ctx->state, state))
+    return false;
+  ctx->state = state;
+  return true;
+}
+
+// Clock TCK in the current state at least clocks times and for at least
+// secs. Waits are clocked out rather than slept so they queue up with
+// everything else instead of forcing a flush.
+bool svf_wait(struct svf_ctx *ctx, unsigned long clocks, double secs) {
+  if (secs > 0) {
+    double c = secs * ctx->jtag->freq;
+    unsigned long n = c;
+
+    if (ctx->jtag->freq <= 0) {
+      fprintf(stderr, "%s: TCK frequency unknown, can't time waits!\n",
+              ctx->file);
+      return false;
+    }
+    if (n < c)
+      n++;
+    if (n > clocks)
+      clocks = n;
+  }
+  return clocks == 0 || jtag_send_clocks(ctx->jtag, clocks);
+}
+
+// Space for the TDO of a deferred capture, the expected value and the mask
+// follow it and start out zero
+uint8_t *svf_add_check(struct svf_ctx *ctx, unsigned int bits) {
+  size_t bytes = bit_bytes(bits);
+  struct svf_check *c;
+
+  if (ctx->n_checks == ctx->checks_size) {
+    size_t size = ctx->checks_size ? ctx->checks_size * 2 : 64;
+    c = realloc(ctx->checks, size * sizeof(*c));
+    if (c == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      return NULL;
+    }
+    ctx->checks = c;
+    ctx->checks_size = size;
+  }
+
+  c = &ctx->checks[ctx->n_checks];
+  c->data = calloc(3, bytes);
+  if (c->data == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return NULL;
+  }
+  c->pos = ctx->statement;
+  c->bits = bits;
+  ctx->n_checks++;
+  return c->data;
+}
+
+// Collect the TDO of all deferred captures and compare it. A mismatch is
+// only noticed here, after the statements that followed it were run.
+bool svf_compare(struct svf_ctx *ctx) {
+  bool ok = jtag_collect(ctx->jtag);
+
+  for (size_t i = 0; i < ctx->n_checks; i++) {
+    struct svf_check *c = &ctx->checks[i];
+    size_t bytes = bit_bytes(c->bits);
+    const uint8_t *expected = c->data + bytes, *mask = expected + bytes;
+
+    if (ok && !jtag_bits_match(c->data, expected, mask, c->bits)) {
+      if (ctx->xsvf)
+        fprintf(stderr, "%s: TDO mismatch in the command at offset %zu\n",
+                ctx->file, c->pos);
+      else
+        fprintf(stderr, "%s:%zu: TDO mismatch\n", ctx->file, c->pos);
+      if (c->bits <= PRINT_BITS) {
+        print_vector("  read:     ", c->data, c->bits);
+        print_vector("  expected: ", expected, c->bits);
+        print_vector("  mask:     ", mask, c->bits);
+      }
+      ok = false;
+    }
+    free(c->data);
+  }
+  ctx->n_checks = 0;
+  return ok;
+}
+
+// Queue a shift whose TDO is compared later. Without an expected value the
+// mask stays zero and nothing is compared, which is also how 1 bit shifts
+// go out since jtag_shift() doesn't do them exactly.
+bool svf_capture(struct svf_ctx *ctx, unsigned int bits, const uint8_t *tdi,
+                 const uint8_t *expected, const uint8_t *mask) {
+  size_t bytes = bit_bytes(bits);
+  uint8_t *data = svf_add_check(ctx, bits);
+
+  if (data == NULL)
+    return false;
+  if (expected) {
+    memcpy(data + bytes, expected, bytes);
+    memcpy(data + 2 * bytes, mask, bytes);
+  }
+  if (!jtag_shift_defer(ctx->jtag, bits, tdi, data))
+    return false;
+
+  return ctx->n_checks < CHECK_MAX || svf_compare(ctx);
+}
+
+// Split the next statement into words. Returns with eof set once only
+// whitespace and comments are left.
+bool next_statement(struct svf_ctx *ctx, struct svf_word *words, size_t *n,
+                    bool *eof) {
+  *n = 0;
+  *eof = false;
+
+  while (ctx->pos < ctx->end) {
+    char c = *ctx->pos;
+
+    if (c == '\n') {
+      ctx->line++;
+      ctx->pos++;
+      continue;
+    }
+    if (isspace((unsigned char)c)) {
+      ctx->pos++;
+      continue;
+    }
+    if (c == '!' || (c == '/' && ctx->pos + 1 < ctx->end &&
+                     ctx->pos[1] == '/')) {
+      while (ctx->pos < ctx->end && *ctx->pos != '\n')
+        ctx->pos++;
+      continue;
+    }
+
+    if (*n == 0)
+      ctx->statement = ctx->line;
+    if (c == ';') {
+      ctx->pos++;
+      return true;
+    }
+    if (*n == SVF_WORDS) {
+      fprintf(stderr, "%s:%zu: statement too long!\n", ctx->file,
+              ctx->statement);
+      return false;
+    }
+
+    struct svf_word *w = &words[(*n)++];
+    if (c == '(') {
+      const char *close = memchr(ctx->pos, ')', ctx->end - ctx->pos);
+      if (close == NULL) {
+        fprintf(stderr, "%s:%zu: missing ')'!\n", ctx->file, ctx->line);
+        return false;
+      }
+      w->text = ctx->pos + 1;
+      w->len = close - w->text;
+      w->value = true;
+      for (const char *p = w->text; p < close; p++)
+        ctx->line += *p == '\n';
+      ctx->pos = close + 1;
+    } else {
+      w->text = ctx->pos;
+      while (ctx->pos < ctx->end && !isspace((unsigned char)*ctx->pos) &&
+             *ctx->pos != ';' && *ctx->pos != '(' && *ctx->pos != '!')
+        ctx->pos++;
+      w->len = ctx->pos - w->text;
+      w->value = false;
+    }
+  }
+
+  if (*n > 0) {
+    fprintf(stderr, "%s:%zu: missing ';'!\n", ctx->file, ctx->statement);
+    return false;
+  }
+  *eof = true;
+  return true;
+}
+
+bool word_is(const struct svf_word *w, const char *keyword) {
+  return !w->value && strlen(keyword) == w->len &&
+         strncasecmp(w->text, keyword, w->len) == 0;
+}
+
+bool parse_number(struct svf_ctx *ctx, const struct svf_word *w,
+                  double *value) {
+  char tmp[64], *end;
+
+  if (w->value || w->len == 0 || w->len >= sizeof(tmp)) {
+    fprintf(stderr, "%s:%zu: expected a number!\n", ctx->file,
+            ctx->statement);
+    return false;
+  }
+  memcpy(tmp, w->text, w->len);
+  tmp[w->len] = 0;
+  *value = strtod(tmp, &end);
+  if (*end != 0 || *value < 0) {
+    fprintf(stderr, "%s:%zu: bad number '%s'!\n", ctx->file, ctx->statement,
+            tmp);
+    return false;
+  }
+  return true;
+}
+
+bool parse_state(const struct svf_word *w, enum jtag_fsm_state *state) {
+  for (int i = 0; i < 16; i++) {
+    if (word_is(w, state_names[i])) {
+      *state = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool parse_stable(struct svf_ctx *ctx, const struct svf_word *w,
+                  enum jtag_fsm_state *state) {
+  if (!parse_state(w, state) || !is_stable(*state)) {
+    fprintf(stderr, "%s:%zu: '%.*s' isn't a stable state!\n", ctx->file,
+            ctx->statement, (int)w->len, w->text);
+    return false;
+  }
+  return true;
+}
+
+// Values are hex MSB first, their last digit holds the first bits shifted.
+// Missing digits are zeros, whitespace between them is allowed.
+bool parse_hex(struct svf_ctx *ctx, const struct svf_word *w, uint8_t *dst,
+               unsigned int bits) {
+  unsigned int bit = 0;
+
+  memset(dst, 0, bit_bytes(bits));
+  for (size_t i = w->len; i-- > 0;) {
+    unsigned char c = w->text[i];
+    int v;
+
+    if (isspace(c))
+      continue;
+    if (!isxdigit(c)) {
+      fprintf(stderr, "%s:%zu: bad hex digit '%c'!\n", ctx->file,
+              ctx->statement, c);
+      return false;
+    }
+    v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+    for (int j = 0; j < 4; j++, bit++) {
+      if (((v >> j) & 0x01) == 0)
+        continue;
+      if (bit >= bits) {
+        fprintf(stderr, "%s:%zu: value is longer than %u bits!\n", ctx->file,
+                ctx->statement, bits);
+        return false;
+      }
+      dst[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+  return true;
+}
+
+bool svf_run(struct svf_ctx *ctx, const struct svf_word *w, size_t n) {
+  static const char *const regs[] = {"HDR", "HIR", "SDR", "SIR", "TDR", "TIR"};
+
+  for (int i = 0; i < SVF_REGS; i++) {
+    if (!word_is(&w[0], regs[i]))
+      continue;
+    if (!svf_scan(ctx, i, w, n))
+      return false;
+    if (i == SDR || i == SIR)
+      return svf_shift(ctx, i == SIR);
+    return true;
+  }
+
+  if (word_is(&w[0], "ENDIR") || word_is(&w[0], "ENDDR")) {
+    if (n != 2) {
+      fprintf(stderr, "%s:%zu: %.*s takes one state!\n", ctx->file,
+              ctx->statement, (int)w[0].len, w[0].text);
+      return false;
+    }
+    return parse_stable(ctx, &w[1],
+                        word_is(&w[0], "ENDIR") ? &ctx->end_ir : &ctx->end_dr);
+  }
+  if (word_is(&w[0], "RUNTEST"))
+    return svf_runtest(ctx, w, n);
+  if (word_is(&w[0], "STATE"))
+    return svf_state(ctx, w, n);
+  if (word_is(&w[0], "FREQUENCY"))
+    return svf_frequency(ctx, w, n);
+  if (word_is(&w[0], "TRST")) {
+    // There's no TRST pin, the TAP is reset through TMS instead
+    if (n == 2 && word_is(&w[1], "ON"))
+      return svf_reset(ctx);
+    return true;
+  }
+
+  fprintf(stderr, "%s:%zu: %.*s isn't supported!\n", ctx->file,
+          ctx->statement, (int)w[0].len, w[0].text);
+  return false;
+}
+
+// Update a scan pattern. TDI, MASK and SMASK carry over to later statements
+// with the same length, TDO is only compared when it's given.
+bool svf_scan(struct svf_ctx *ctx, enum svf_reg reg, const struct svf_word *w,
+              size_t n) {
+  struct svf_scan *s = &ctx->scan[reg];
+  bool tdi = false;
+  double length;
+
+  if (n < 2 || !parse_number(ctx, &w[1], &length))
+    return false;
+  if (!(length >= 0 && length <= SVF_MAX_BITS) ||
+      length != (unsigned int)length) {
+    fprintf(stderr, "%s:%zu: bad scan length, at most %u bits are allowed!\n",
+            ctx->file, ctx->statement, SVF_MAX_BITS);
+    return false;
+  }
+
+  unsigned int bits = length;
+  size_t bytes = bit_bytes(bits);
+  bool resized = bits != s->bits || s->tdi == NULL;
+  if (resized) {
+    uint8_t *data = realloc(s->tdi, 4 * bytes + 1);
+    if (data == NULL) {
+      fprintf(stderr, "Out of memory!\n");
+      return false;
+    }
+    s->bits = bits;
+    s->tdi = data;
+    s->tdo = data + bytes;
+    s->mask = data + 2 * bytes;
+    s->smask = data + 3 * bytes;
+    memset(s->tdi, 0, 2 * bytes);
+    memset(s->mask, 0xFF, 2 * bytes);
+  }
+
+  s->check = false;
+  for (size_t i = 2; i < n; i += 2) {
+    uint8_t *dst = NULL;
+
+    if (word_is(&w[i], "TDI"))
+      dst = s->tdi;
+    else if (word_is(&w[i], "TDO"))
+      dst = s->tdo;
+    else if (word_is(&w[i], "MASK"))
+      dst = s->mask;
+    else if (word_is(&w[i], "SMASK"))
+      dst = s->smask;
+
+    if (dst == NULL || i + 1 == n || !w[i + 1].value) {
+      fprintf(stderr, "%s:%zu: bad %.*s parameter '%.*s'!\n", ctx->file,
+              ctx->statement, (int)w[0].len, w[0].text, (int)w[i].len,
+              w[i].text);
+      return false;
+    }
+    if (!parse_hex(ctx, &w[i + 1], dst, bits))
+      return false;
+    tdi |= dst == s->tdi;
+    s->check |= dst == s->tdo;
+  }
+
+  if (resized && bits > 0 && !tdi) {
+    fprintf(stderr, "%s:%zu: TDI is needed when the length changes!\n",
+            ctx->file, ctx->statement);
+    return false;
+  }
+  return true;
+}
+
+// Run an SIR or SDR with its header and trailer. The header is shifted
+// first, then the data and the trailer.
+bool svf_shift(struct svf_ctx *ctx, bool ir) {
+  const struct svf_scan *parts[] = {&ctx->scan[ir ? HIR : HDR],
+                                    &ctx->scan[ir ? SIR : SDR],
+                                    &ctx->scan[ir ? TIR : TDR]};
+  enum jtag_fsm_state end = ir ? ctx->end_ir : ctx->end_dr;
+  size_t bits = 0;
+  bool check = false;
+
+  for (int i = 0; i < 3; i++) {
+    bits += parts[i]->bits;
+    check |= parts[i]->check;
+  }
+  if (bits == 0)
+    return svf_goto(ctx, end);
+  if (bits > SVF_MAX_BITS) {
+    fprintf(stderr, "%s:%zu: scan with header and trailer is over %u bits!\n",
+            ctx->file, ctx->statement, SVF_MAX_BITS);
+    return false;
+  }
+
+  size_t bytes = bit_bytes(bits);
+  uint8_t *tdi = grow(&ctx->tdi, &ctx->tdi_size, 3 * bytes);
+  if (tdi == NULL)
+    return false;
+  uint8_t *expected = tdi + bytes, *mask = expected + bytes;
+
+  memset(tdi, 0, 3 * bytes);
+  for (int i = 0, offset = 0; i < 3; offset += parts[i++]->bits) {
+    copy_bits(tdi, offset, parts[i]->tdi, parts[i]->bits);
+    if (parts[i]->check) {
+      copy_bits(expected, offset, parts[i]->tdo, parts[i]->bits);
+      copy_bits(mask, offset, parts[i]->mask, parts[i]->bits);
+    }
+  }
+
+  if (!svf_goto(ctx, ir ? SHIFT_IR : SHIFT_DR))
+    return false;
+  jtag_shift_exit(ctx->jtag, ir ? EXIT1_IR : EXIT1_DR, end);
+  ctx->state = end;
+
+  if (check || bits < 2)
+    return svf_capture(ctx, bits, tdi, check ? expected : NULL, mask);
+  return jtag_shift(ctx->jtag, bits, tdi, NULL);
+}
+
+// RUNTEST [run_state] count TCK|SCK [min SEC [MAXIMUM max SEC]]
+//         [ENDSTATE end_state], or with only the time
+bool svf_runtest(struct svf_ctx *ctx, const struct svf_word *w, size_t n) {
+  unsigned long clocks = 0;
+  double secs = 0, value;
+  size_t i = 1;
+
+  if (i < n && parse_state(&w[i], &ctx->run_state)) {
+    if (!parse_stable(ctx, &w[i], &ctx->run_state))
+      return false;
+    ctx->run_end = ctx->run_state;
+    i++;
+  }
+
+  if (i + 1 < n && !word_is(&w[i], "ENDSTATE")) {
+    if (!parse_number(ctx, &w[i], &value))
+      return false;
+    if (word_is(&w[i + 1], "TCK")) {
+      clocks = value;
+    } else if (word_is(&w[i + 1], "SEC")) {
+      secs = value;
+    } else if (!word_is(&w[i + 1], "SCK")) {
+      fprintf(stderr, "%s:%zu: bad RUNTEST unit!\n", ctx->file,
+              ctx->statement);
+      return false;
+    }
+    i += 2;
+  }
+  if (secs == 0 && i + 1 < n && word_is(&w[i + 1], "SEC")) {
+    if (!parse_number(ctx, &w[i], &secs))
+      return false;
+    i += 2;
+  }
+  // The upper limit never matters, waits are as short as allowed
+  if (i + 2 < n && word_is(&w[i], "MAXIMUM"))
+    i += 3;
+  if (i + 1 < n && word_is(&w[i], "ENDSTATE")) {
+    if (!parse_stable(ctx, &w[i + 1], &ctx->run_end))
+      return false;
+    i += 2;
+  }
+  if (i != n) {
+    fprintf(stderr, "%s:%zu: bad RUNTEST!\n", ctx->file, ctx->statement);
+    return false;
+  }
+
+  return svf_goto(ctx, ctx->run_state) && svf_wait(ctx, clocks, secs) &&
+         svf_goto(ctx, ctx->run_end);
+}
+
+// STATE [path...] end_state
+bool svf_state(struct svf_ctx *ctx, const struct svf_word *w, size_t n) {
+  enum jtag_fsm_state state = ctx->state;
+
+  for (size_t i = 1; i < n; i++) {
+    if (!parse_state(&w[i], &state)) {
+      fprintf(stderr, "%s:%zu: unknown state '%.*s'!\n", ctx->file,
+              ctx->statement, (int)w[i].len, w[i].text);
+      return false;
+    }
+    if (state == TEST_LOGIC_RESET) {
+      if (!svf_reset(ctx))
+        return false;
+    } else if (!svf_goto(ctx, state)) {
+      return false;
+    }
+  }
+
+  if (n < 2 || !is_stable(state)) {
+    fprintf(stderr, "%s:%zu: STATE has to end in a stable state!\n",
+            ctx->file, ctx->statement);
+    return false;
+  }
+  return true;
+}
+
+// FREQUENCY [cycles HZ], without a value TCK goes back to where it started
+bool svf_frequency(struct svf_ctx *ctx, const struct svf_word *w, size_t n) {
+  double freq = ctx->freq;
+
+  if (n == 3 && word_is(&w[2], "HZ")) {
+    if (!parse_number(ctx, &w[1], &freq))
+      return false;
+  } else if (n != 1) {
+    fprintf(stderr, "%s:%zu: bad FREQUENCY!\n", ctx->file, ctx->statement);
+    return false;
+  }
+  return freq <= 0 || jtag_set_freq(ctx->jtag, freq);
+}
+
+bool svf_play(struct jtag_ctx *jtag, const char *file) {
+  struct svf_word words[SVF_WORDS];
+  struct image *img;
+  struct svf_ctx ctx;
+  bool ok, eof = false;
+  size_t n;
+
+  if ((img = image_open(file)) == NULL)
+    return false;
+
+  svf_init(&ctx, jtag, file, img);
+  ok = svf_reset(&ctx);
+  while (ok && !eof) {
+    ok = next_statement(&ctx, words, &n, &eof);
+    if (ok && n > 0)
+      ok = svf_run(&ctx, words, n);
+  }
+  ok = ok && svf_compare(&ctx) && jtag_flush(jtag);
+
+  // A failed run can leave shifts deferred into buffers freed below
+  jtag_discard(jtag);
+  svf_free(&ctx);
+  image_close(img);
+  return ok;
+}
+
+// Take the next n bytes of an XSVF file
+const uint8_t *xsvf_take(struct svf_ctx *ctx, size_t n) {
+  const char *data = ctx->pos;
+
+  if ((size_t)(ctx->end - ctx->pos) < n) {
+    fprintf(stderr, "%s: command at offset %zu is cut short!\n", ctx->file,
+            ctx->statement);
+    return NULL;
+  }
+  ctx->pos += n;
+  return (const uint8_t *)data;
+}
+
+// XSVF numbers are big endian
+unsigned long xsvf_number(const uint8_t *data, size_t n) {
+  unsigned long value = 0;
+
+  for (size_t i = 0; i < n; i++)
+    value = value << 8 | data[i];
+  return value;
+}
+
+// XSVF vectors are stored MSB first like SVF values
+void xsvf_vector(uint8_t *dst, const uint8_t *src, unsigned int bits) {
+  size_t bytes = bit_bytes(bits);
+
+  for (size_t i = 0; i < bytes; i++)
+    dst[i] = src[bytes - 1 - i];
+}
+
+bool xsvf_sdr_size(struct svf_ctx *ctx, unsigned int bits) {
+  size_t bytes = bit_bytes(bits);
+  uint8_t *data;
+
+  if (bits > SVF_MAX_BITS) {
+    fprintf(stderr, "%s: XSDRSIZE at offset %zu is over %u bits!\n",
+            ctx->file, ctx->statement, SVF_MAX_BITS);
+    return false;
+  }
+  if ((data = realloc(ctx->expected, 2 * bytes + 1)) == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return false;
+  }
+  ctx->sdr_bits = bits;
+  ctx->expected = data;
+  ctx->mask = data + bytes;
+  memset(data, 0, 2 * bytes);
+  return true;
+}
+
+// Shift an XIR or XDR and wait usecs in the end state. When TDO is checked
+// with repeats left and a wait to lengthen, it's read right away and the
+// shift is tried again from PAUSE-DR on a mismatch. Anything else is
+// compared later with the rest.
+bool xsvf_shift(struct svf_ctx *ctx, bool ir, unsigned int bits,
+                const uint8_t *tdi, bool check, unsigned int repeat,
+                unsigned long usecs) {
+  enum jtag_fsm_state exit1 = ir ? EXIT1_IR : EXIT1_DR;
+  enum jtag_fsm_state end = ir ? ctx->end_ir : ctx->end_dr;
+  size_t bytes = bit_bytes(bits);
+
+  if (bits == 0)
+    return svf_goto(ctx, end) && svf_wait(ctx, usecs, usecs / 1e6);
+  if (!svf_goto(ctx, ir ? SHIFT_IR : SHIFT_DR))
+    return false;
+
+  if (!check || repeat == 0 || usecs == 0) {
+    jtag_shift_exit(ctx->jtag, exit1, end);
+    ctx->state = end;
+    if (check || bits < 2) {
+      if (!svf_capture(ctx, bits, tdi, check ? ctx->expected : NULL,
+                       ctx->mask))
+        return false;
+    } else if (!jtag_shift(ctx->jtag, bits, tdi, NULL)) {
+      return false;
+    }
+    return svf_wait(ctx, usecs, usecs / 1e6);
+  }
+
+  uint8_t *tdo = grow(&ctx->tdo, &ctx->tdo_size, bytes);
+  if (tdo == NULL)
+    return false;
+
+  for (unsigned int attempt = 0;; attempt++) {
+    ctx->state = exit1;
+    if (!jtag_shift_defer(ctx->jtag, bits, tdi, tdo) ||
+        !jtag_collect(ctx->jtag))
+      return false;
+    if (jtag_bits_match(tdo, ctx->expected, ctx->mask, bits))
+      break;
+    if (attempt == repeat) {
+      fprintf(stderr,
+              "%s: TDO mismatch in the command at offset %zu after %u "
+              "tries\n",
+              ctx->file, ctx->statement, attempt + 1);
+      return false;
+    }
+
+    usecs += usecs / 4;
+    if (!svf_goto(ctx, PAUSE_DR) || !svf_wait(ctx, usecs, usecs / 1e6) ||
+        !svf_goto(ctx, SHIFT_DR))
+      return false;
+  }
+
+  return svf_goto(ctx, end) && svf_wait(ctx, usecs, usecs / 1e6);
+}
+
+bool xsvf_run(struct svf_ctx *ctx, bool *complete, unsigned int *repeat,
+              unsigned long *usecs) {
+  size_t sdr_bytes = bit_bytes(ctx->sdr_bits);
+  const uint8_t *data;
+  unsigned int bits;
+
+  ctx->statement = ctx->pos - ctx->data;
+  if ((data = xsvf_take(ctx, 1)) == NULL)
+    return false;
+
+  switch (data[0]) {
+  case XCOMPLETE:
+    *complete = true;
+    return true;
+
+  case XTDOMASK:
+    if ((data = xsvf_take(ctx, sdr_bytes)) == NULL)
+      return false;
+    xsvf_vector(ctx->mask, data, ctx->sdr_bits);
+    return true;
+
+  case XSIR:
+  case XSIR2: {
+    size_t length = data[0] == XSIR ? 1 : 2;
+
+    if ((data = xsvf_take(ctx, length)) == NULL)
+      return false;
+    bits = xsvf_number(data, length);
+    if ((data = xsvf_take(ctx, bit_bytes(bits))) == NULL ||
+        grow(&ctx->tdi, &ctx->tdi_size, bit_bytes(bits) + 1) == NULL)
+      return false;
+    xsvf_vector(ctx->tdi, data, bits);
+    return xsvf_shift(ctx, true, bits, ctx->tdi, false, 0, *usecs);
+  }
+
+  case XSDR:
+  case XSDRTDO: {
+    bool tdo = data[0] == XSDRTDO;
+
+    // XSDR compares against the last expected value too
+    if ((data = xsvf_take(ctx, sdr_bytes * (tdo ? 2 : 1))) == NULL ||
+        grow(&ctx->tdi, &ctx->tdi_size, sdr_bytes + 1) == NULL)
+      return false;
+    xsvf_vector(ctx->tdi, data, ctx->sdr_bits);
+    if (tdo)
+      xsvf_vector(ctx->expected, data + sdr_bytes, ctx->sdr_bits);
+
+    bool check = false;
+    for (size_t i = 0; i < sdr_bytes; i++)
+      check |= ctx->mask[i] != 0;
+    return xsvf_shift(ctx, false, ctx->sdr_bits, ctx->tdi, check, *repeat,
+                      *usecs);
+  }
+
+  case XRUNTEST:
+    if ((data = xsvf_take(ctx, 4)) == NULL)
+      return false;
+    *usecs = xsvf_number(data, 4);
+    return true;
+
+  case XREPEAT:
+    if ((data = xsvf_take(ctx, 1)) == NULL)
+      return false;
+    *repeat = data[0];
+    return true;
+
+  case XSDRSIZE:
+    if ((data = xsvf_take(ctx, 4)) == NULL)
+      return false;
+    return xsvf_sdr_size(ctx, xsvf_number(data, 4));
+
+  case XSTATE:
+    if ((data = xsvf_take(ctx, 1)) == NULL)
+      return false;
+    if (data[0] == TEST_LOGIC_RESET)
+      return svf_reset(ctx);
+    if (data[0] > UPDATE_IR)
+      break;
+    return svf_goto(ctx, (enum jtag_fsm_state)data[0]);
+
+  case XENDIR:
+  case XENDDR: {
+    bool ir = data[0] == XENDIR;
+
+    if ((data = xsvf_take(ctx, 1)) == NULL)
+      return false;
+    if (data[0] > 1)
+      break;
+    if (ir)
+      ctx->end_ir = data[0] ? PAUSE_IR : RUN_TEST_IDLE;
+    else
+      ctx->end_dr = data[0] ? PAUSE_DR : RUN_TEST_IDLE;
+    return true;
+  }
+
+  case XCOMMENT:
+    while ((data = xsvf_take(ctx, 1)) != NULL && data[0] != 0)
+      ;
+    return data != NULL;
+
+  case XWAIT:
+    if ((data = xsvf_take(ctx, 6)) == NULL)
+      return false;
+    if (data[0] > UPDATE_IR || data[1] > UPDATE_IR)
+      break;
+    *usecs = xsvf_number(data + 2, 4);
+    return svf_goto(ctx, (enum jtag_fsm_state)data[0]) &&
+           svf_wait(ctx, *usecs, *usecs / 1e6) &&
+           svf_goto(ctx, (enum jtag_fsm_state)data[1]);
+
+  default:
+    fprintf(stderr, "%s: XSVF command 0x%02X at offset %zu isn't supported!\n",
+            ctx->file, data[0], ctx->statement);
+    return false;
+  }
+
+  fprintf(stderr, "%s: bad state in the command at offset %zu!\n", ctx->file,
+          ctx->statement);
+  return false;
+}
+
+bool xsvf_play(struct jtag_ctx *jtag, const char *file) {
+  struct image *img;
+  struct svf_ctx ctx;
+  bool ok, complete = false;
+  unsigned int repeat = 0;
+  unsigned long usecs = 0;
+
+  if ((img = image_open(file)) == NULL)
+    return false;
+
+  svf_init(&ctx, jtag, file, img);
+  ctx.xsvf = true;
+  ok = svf_reset(&ctx) && xsvf_sdr_size(&ctx, 0);
+  while (ok && !complete && ctx.pos < ctx.end)
+    ok = xsvf_run(&ctx, &complete, &repeat, &usecs);
+  ok = ok && svf_compare(&ctx) && jtag_flush(jtag);
+
+  // A failed run can leave shifts deferred into buffers freed below
+  jtag_discard(jtag);
+  svf_free(&ctx);
+  image_close(img);
+  return ok;
+}
+
+bool svf_play_file(struct jtag_ctx *jtag, const char *file) {
+  size_t len = strlen(file);
+
+  if (len > 5 && strcasecmp(file + len - 5, ".xsvf") == 0)
+    return xsvf_play(jtag, file);
+  return svf_play(jtag, file);
+}
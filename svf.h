@@ -0,0 +1,22 @@
+#ifndef SVF_H_
+#define SVF_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "jtag.h"
+
+// Run a Serial Vector Format file, or an XSVF one when the name ends in
+// .xsvf, on the JTAG chain. The TAP is reset first and left where the file
+// leaves it.
+bool svf_play_file(struct jtag_ctx *jtag, const char *file);
+bool svf_play(struct jtag_ctx *jtag, const char *file);
+bool xsvf_play(struct jtag_ctx *jtag, const char *file);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* SVF_H_ */
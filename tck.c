@@ -0,0 +1,112 @@
+#include "tck.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TCK_FILE "tck"
+#define KEY_MAX 64
+
+static bool tck_path(char *path, size_t len, bool create);
+static bool tck_write(const char *key, double freq);
+
+// Boards programmed in parallel save to the same file
+static pthread_mutex_t tck_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// One "key frequency" pair per line, the key from board_key()
+bool tck_path(char *path, size_t len, bool create) {
+  const char *xdg = getenv("XDG_CONFIG_HOME");
+  const char *home = getenv("HOME");
+  int n;
+
+  if (xdg && *xdg)
+    n = snprintf(path, len, "%s/alchitry_loader", xdg);
+  else if (home && *home)
+    n = snprintf(path, len, "%s/.config/alchitry_loader", home);
+  else
+    return false;
+  if (n < 0 || (size_t)n >= len)
+    return false;
+
+  if (create) {
+    // Create each missing directory along the way
+    for (char *p = path + 1; *p; p++) {
+      if (*p == '/') {
+        *p = 0;
+        mkdir(path, 0755);
+        *p = '/';
+      }
+    }
+    mkdir(path, 0755);
+  }
+
+  n = snprintf(path + n, len - n, "/%s", TCK_FILE);
+  return n > 0 && (size_t)n < len;
+}
+
+bool tck_load(const char *key, double *freq) {
+  char path[PATH_MAX], entry[KEY_MAX];
+  double f;
+  bool found = false;
+
+  if (!tck_path(path, sizeof(path), false))
+    return false;
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    return false;
+
+  while (fscanf(fp, "%63s %lf", entry, &f) == 2) {
+    if (strcmp(entry, key) == 0 && f > 0) {
+      *freq = f;
+      found = true;
+    }
+  }
+
+  fclose(fp);
+  return found;
+}
+
+bool tck_save(const char *key, double freq) {
+  pthread_mutex_lock(&tck_lock);
+  bool ok = tck_write(key, freq);
+  pthread_mutex_unlock(&tck_lock);
+  return ok;
+}
+
+bool tck_write(const char *key, double freq) {
+  char path[PATH_MAX], tmp[PATH_MAX + 16], entry[KEY_MAX];
+  double f;
+
+  if (!tck_path(path, sizeof(path), true))
+    return false;
+  // Other processes may be saving too, each writes its own file
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) {
+    fprintf(stderr, "Can't open '%s' for writing!\n", tmp);
+    return false;
+  }
+
+  // Keep the other boards
+  FILE *in = fopen(path, "r");
+  if (in) {
+    while (fscanf(in, "%63s %lf", entry, &f) == 2) {
+      if (strcmp(entry, key) != 0)
+        fprintf(out, "%s %.0f\n", entry, f);
+    }
+    fclose(in);
+  }
+  fprintf(out, "%s %.0f\n", key, freq);
+
+  if (fclose(out) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "Failed to save TCK settings to '%s'!\n", path);
+    remove(tmp);
+    return false;
+  }
+  return true;
+}
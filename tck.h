@@ -0,0 +1,18 @@
+#ifndef TCK_H_
+#define TCK_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+// Best working TCK frequency per board, by board_key(), kept in
+// $XDG_CONFIG_HOME/alchitry_loader/tck (or ~/.config/...)
+bool tck_load(const char *key, double *freq);
+bool tck_save(const char *key, double freq);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* TCK_H_ */
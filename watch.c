@@ -0,0 +1,296 @@
+#include "watch.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "boards.h"
+
+#define POLL_USECS 200000 // how often the event loop checks for a signal
+
+// A board that was plugged in and waits for a worker
+struct arrival {
+  struct arrival *next;
+  libusb_device *dev; // referenced until its job is done
+  double at;          // when libusb saw it, session_seconds()
+};
+
+struct watch {
+  const struct watch_job *job;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct arrival *head, *tail;
+  bool stopping;
+  unsigned int boards; // numbers the boards in messages
+
+  // Arrival to programmed latency of the boards done so far
+  unsigned int done, failed;
+  double latency_sum, latency_min, latency_max;
+};
+
+struct watch_worker {
+  struct watch *w;
+  struct ftdi_context *ftdi; // reads strings and writes EEPROMs
+  pthread_t thread;
+  bool started;
+};
+
+static int on_hotplug(libusb_context *ctx, libusb_device *dev,
+                      libusb_hotplug_event event, void *arg);
+static struct arrival *next_arrival(struct watch *w);
+static bool has_steps(const struct options *opt);
+static bool provision(struct ftdi_context *ftdi, struct board_info *info,
+                      int blank_type);
+static void program(struct watch *w, struct ftdi_context *ftdi,
+                    const struct arrival *a);
+static void *watch_thread(void *arg);
+
+// Runs on the event loop, which mustn't do USB I/O, so arrivals are only
+// queued for the workers
+int on_hotplug(libusb_context *ctx, libusb_device *dev,
+               libusb_hotplug_event event, void *arg) {
+  struct watch *w = arg;
+  char path[32];
+
+  if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+    board_path(dev, path, sizeof(path));
+    fprintf(stdout, "Board at %s unplugged\n", path);
+    return 0;
+  }
+
+  struct arrival *a = calloc(1, sizeof(*a));
+  if (a == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    return 0;
+  }
+  a->dev = libusb_ref_device(dev);
+  a->at = session_seconds();
+
+  pthread_mutex_lock(&w->lock);
+  if (w->tail)
+    w->tail->next = a;
+  else
+    w->head = a;
+  w->tail = a;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+// Wait for a board to program, NULL once the watch stops
+struct arrival *next_arrival(struct watch *w) {
+  struct arrival *a = NULL;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->stopping && w->head == NULL)
+    pthread_cond_wait(&w->cond, &w->lock);
+  if (!w->stopping) {
+    a = w->head;
+    w->head = a->next;
+    if (w->head == NULL)
+      w->tail = NULL;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return a;
+}
+
+bool has_steps(const struct options *opt) {
+  return opt->erase || opt->fpga_flash || opt->fpga_ram || opt->fpga_verify ||
+         opt->fpga_dump || opt->svf;
+}
+
+// A blank FTDI becomes blank_type. It keeps its USB strings until it's
+// plugged in again, so info is updated to what it is now.
+bool provision(struct ftdi_context *ftdi, struct board_info *info,
+               int blank_type) {
+  int type = info->type == BOARD_UNKNOWN ? blank_type : info->type;
+
+  if (!board_open(ftdi, info))
+    return false;
+  bool ok = board_provision(ftdi, type, info->serial);
+  ftdi_usb_close(ftdi);
+
+  if (ok && info->type != type) {
+    info->type = type;
+    strcpy(info->desc, board_name(type));
+  }
+  return ok;
+}
+
+void program(struct watch *w, struct ftdi_context *ftdi,
+             const struct arrival *a) {
+  const struct watch_job *job = w->job;
+  struct session s = {0};
+  double waited = session_seconds() - a->at;
+  bool ok;
+
+  if (!board_identify(ftdi, a->dev, &s.info))
+    return;
+  if (s.info.type == BOARD_UNKNOWN) {
+    // Other FTDI devices share the VID:PID, they're never written to
+    if (!board_blank(&s.info)) {
+      fprintf(stdout, "Ignoring \"%s\" at %s, not an Alchitry board\n",
+              s.info.desc, s.info.path);
+      return;
+    }
+    if (!job->eeprom) {
+      fprintf(stdout, "Ignoring blank FTDI at %s, -u would set it up\n",
+              s.info.path);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&w->lock);
+  s.index = w->boards++;
+  pthread_mutex_unlock(&w->lock);
+  fprintf(stdout, "Board %u (%s %s) plugged in at %s\n", s.index,
+          s.info.desc, s.info.serial, s.info.path);
+
+  ok = !job->eeprom || provision(ftdi, &s.info, job->blank_type);
+  if (ok && has_steps(&job->opt)) {
+    ok = session_run(&s, &job->opt);
+    session_close(&s);
+  }
+  double latency = session_seconds() - a->at;
+
+  pthread_mutex_lock(&w->lock);
+  if (ok) {
+    if (w->done == 0 || latency < w->latency_min)
+      w->latency_min = latency;
+    if (latency > w->latency_max)
+      w->latency_max = latency;
+    w->latency_sum += latency;
+    w->done++;
+  } else {
+    w->failed++;
+  }
+  unsigned int done = w->done, failed = w->failed;
+  pthread_mutex_unlock(&w->lock);
+
+  fprintf(stdout,
+          "Board %u (%s %s): %s %.2f s after plugging in (%.2f s queued), "
+          "%u done, %u failed\n",
+          s.index, board_name(s.info.type), s.info.serial,
+          ok ? "done" : "FAILED", latency, waited, done, failed);
+}
+
+void *watch_thread(void *arg) {
+  struct watch_worker *worker = arg;
+  struct arrival *a;
+
+  while ((a = next_arrival(worker->w)) != NULL) {
+    program(worker->w, worker->ftdi, a);
+    libusb_unref_device(a->dev);
+    free(a);
+  }
+  return NULL;
+}
+
+// Program every Au or Cu plugged in from now until SIGINT or SIGTERM. Up to
+// job->workers boards are programmed at once, the ones plugged in while
+// they're all busy wait their turn. Boards already connected are left
+// alone.
+int watch_run(const struct watch_job *job) {
+  struct watch w = {.job = job};
+  struct watch_worker *workers;
+  libusb_context *ctx;
+  libusb_hotplug_callback_handle handle;
+  sigset_t signals, old;
+  unsigned int i, n = job->workers ? job->workers : 1;
+  int ret = 0;
+
+  if (libusb_init(&ctx) < 0) {
+    fprintf(stderr, "Failed to initialize libusb!\n");
+    return 2;
+  }
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    fprintf(stderr, "This libusb can't watch for boards being plugged in!\n");
+    libusb_exit(ctx);
+    return 2;
+  }
+
+  if ((workers = calloc(n, sizeof(*workers))) == NULL) {
+    fprintf(stderr, "Out of memory!\n");
+    libusb_exit(ctx);
+    return 2;
+  }
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+
+  // Signals belong to the event loop, the workers' USB transfers shouldn't
+  // see them
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, &old);
+  for (i = 0; i < n; i++) {
+    struct watch_worker *worker = &workers[i];
+    worker->w = &w;
+    if ((worker->ftdi = ftdi_new()) == NULL) {
+      fprintf(stderr, "Failed to allocate ftdi structure!\n");
+      break;
+    }
+    worker->started =
+        pthread_create(&worker->thread, NULL, watch_thread, worker) == 0;
+    if (!worker->started) {
+      fprintf(stderr, "Failed to start a worker thread!\n");
+      break;
+    }
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (i < n) {
+    ret = 2;
+  } else if (libusb_hotplug_register_callback(
+                 ctx,
+                 LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+                     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                 LIBUSB_HOTPLUG_NO_FLAGS, VID, PID, LIBUSB_HOTPLUG_MATCH_ANY,
+                 on_hotplug, &w, &handle) != 0) {
+    fprintf(stderr, "Failed to register for hotplug events!\n");
+    ret = 2;
+  } else {
+    session_catch_stop();
+    fprintf(stdout, "Waiting for boards, %u at a time\n", n);
+
+    while (!session_stopping()) {
+      struct timeval tv = {0, POLL_USECS};
+      libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+    }
+    libusb_hotplug_deregister_callback(ctx, handle);
+  }
+
+  // Boards being programmed are finished, waiting ones dropped
+  pthread_mutex_lock(&w.lock);
+  w.stopping = true;
+  pthread_cond_broadcast(&w.cond);
+  pthread_mutex_unlock(&w.lock);
+  for (i = 0; i < n; i++) {
+    if (workers[i].started)
+      pthread_join(workers[i].thread, NULL);
+    if (workers[i].ftdi)
+      ftdi_free(workers[i].ftdi);
+  }
+  free(workers);
+  while (w.head) {
+    struct arrival *a = w.head;
+    w.head = a->next;
+    libusb_unref_device(a->dev);
+    free(a);
+  }
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.lock);
+  libusb_exit(ctx);
+
+  if (w.done > 0) {
+    fprintf(stdout,
+            "%u boards done, %u failed, plugged in to done in %.2f s on "
+            "average (%.2f to %.2f s)\n",
+            w.done, w.failed, w.latency_sum / w.done, w.latency_min,
+            w.latency_max);
+  } else {
+    fprintf(stdout, "%u boards done, %u failed\n", w.done, w.failed);
+  }
+  return ret != 0 || w.failed > 0 ? 2 : 0;
+}
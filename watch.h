@@ -0,0 +1,27 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include "session.h"
+
+#define WATCH_WORKERS 4
+
+// What to do with each board that gets plugged in
+struct watch_job {
+  struct options opt;
+  bool eeprom;          // write the FTDI EEPROM before the other steps
+  int blank_type;       // what blank FTDIs become, see board_blank()
+  unsigned int workers; // boards programmed at once
+};
+
+int watch_run(const struct watch_job *job);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* WATCH_H_ */